@@ -16,9 +16,9 @@ echo "# Autogened at `date +\"%Y/%m/%d %H:%M:%S\"`
 
 BIN = luna
 
-CFLAGS = -g -Wall -std=c99 -D_GNU_SOURCE
+CFLAGS = -g -O2 -Wall -std=c99 -D_GNU_SOURCE
 
-LIBS = #empty
+LIBS = -lm -lpthread
 
 ALL_O = $ALL_O
 
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Run testes/bench/*.lasm with each Value layout: default and -DLUNA_NANBOX,
+# with and without superinstructions (-vmplain),
+# then time loading a big bundle, decoding functions lazily (-vm) and eagerly (-vmeager)
+
+set -e
+set -u
+
+CFLAGS="-g -O2 -Wall -std=c99 -D_GNU_SOURCE"
+
+now() {
+    date +%s.%N
+}
+
+for layout in "" "-DLUNA_NANBOX"; do
+    make clean > /dev/null
+    make CFLAGS="$CFLAGS $layout" > /dev/null
+    echo "layout: ${layout:-default}"
+    for t in testes/bench/*.lasm; do
+        ./luna -as $t
+        for mode in vm vmplain; do
+            begin=`now`
+            ./luna -$mode a.lbin
+            end=`now`
+            echo "    $t -$mode: `echo "$begin $end" | awk '{printf "%.3fs", $2 - $1}'`"
+        done
+    done
+done
+
+# startup: a bundle of many functions of which one runs
+bundle() {
+    awk -v n="$1" 'BEGIN {
+        print "FUNC main {\n    R 2\n    K \"r\"\n    K 7"
+        for (i = 1; i <= n; ++i) print "    F " i
+        print "    CLOSURE 0 0\n    LOADK 1 -2\n    CALL 0 2 2\n    SETGLOBAL 0 -1\n    RETURN 0 1\n}"
+        for (i = 1; i <= n; ++i) {
+            print "FUNC f" i " {\n    P 1\n    R 4\n    K \"name" i "\"\n    K " i "\n    K 2.5"
+            for (j = 0; j < 10; ++j) print "    ADD 1 0 -2\n    MUL 2 1 -3\n    SUB 3 2 -2"
+            print "    RETURN 3 2\n}"
+        }
+    }'
+}
+
+make clean > /dev/null
+make CFLAGS="$CFLAGS" > /dev/null
+bundle 2000 > startup.lasm
+echo "startup, 2000 functions, one .lbin decoded lazily and eagerly:"
+./luna -as startup.lasm
+for mode in vm vmeager; do
+    begin=`now`
+    ./luna -$mode a.lbin
+    end=`now`
+    echo "    -$mode: `echo "$begin $end" | awk '{printf "%.3fs", $2 - $1}'`"
+done
+rm -f startup.lasm
+
+make clean > /dev/null
+rm -f a.lbin
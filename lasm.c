@@ -1,6 +1,9 @@
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include "luna.h"
 #include "lasm.h"
+#include "lbin.h"
 
 #define A_FATAL(...) snapshot(as->src, as->curidx, as->curline); error(__VA_ARGS__)
 
@@ -101,241 +104,466 @@ const char *const A_opnames[] = {
   NULL
 };
 
-enum A_LexState {
-    A_LS_INIT,
-    A_LS_UNARY,     // + | -
-    A_LS_INT,       // 123
-    A_LS_INTDOT,    // 123.
-    A_LS_FLOAT,     // 123.123
-    A_LS_STR_HALF,  // "abc
-    A_LS_STR_ESC,   // "abc\?
-    A_LS_COMMENT,   // ; comment
-    A_LS_IDENT,
-};
+/* iABC operand that may be a constant */
+static int _encoderk(int x, int *out) {
+    if (x < 0) {
+        x = -x - 1;
+        if (x > A_MAXINDEXRK) {
+            return 0;
+        }
+        *out = A_RKASK(x);
+        return 1;
+    }
+    if (x > A_MAXINDEXRK) {
+        return 0;
+    }
+    *out = x;
+    return 1;
+}
 
-static void _add_func(A_State *as, const char *name) {
-    A_Func *f = NEW(A_Func);
-    strncpy(f->name, name, MAX_NAME_LEN);
-    f->regcount = 2;    /* default */
-    f->consts = list_new();
-    f->instrs = list_new();
-    f->subfuncs = list_new();
+static int _encodearg(OpArgMask m, int x, int *out) {
+    if (m == OpArgN) {
+        *out = 0;
+        return 1;
+    }
+    if (m == OpArgK) {
+        return _encoderk(x, out);
+    }
+    if (x < 0 || x > A_MAXARG_B) {
+        return 0;
+    }
+    *out = x;
+    return 1;
+}
+
+int A_encode(const A_Instr *ins, uint32_t *w) {
+    const A_OpMode *om = &A_OpModes[ins->t];
+    int a = om->a == OpArgN ? 0 : ins->a;
+    if (a < 0 || a > A_MAXARG_A) {
+        return 0;
+    }
+    switch (om->m) {
+        case iABC: {
+            int b = 0, c = 0;
+            if (!_encodearg(om->b, ins->u.bc.b, &b) || !_encodearg(om->c, ins->u.bc.c, &c)) {
+                return 0;
+            }
+            *w = A_CREATE_ABC(ins->t, a, b, c);
+        } break;
+
+        case iABx: {
+            int bx = om->b == OpArgN ? 0 : ins->u.bx;
+            if (om->b == OpArgK) {
+                bx = -bx - 1;
+            }
+            if (bx < 0 || bx > A_MAXARG_Bx) {
+                return 0;
+            }
+            *w = A_CREATE_ABx(ins->t, a, bx);
+        } break;
 
-    list_pushback(as->funcs, f);
-    as->curfunc = as->funcs->count;
+        case iAsBx: {
+            int sbx = ins->u.bx;
+            if (sbx < -A_MAXARG_sBx || sbx > A_MAXARG_Bx - A_MAXARG_sBx) {
+                return 0;
+            }
+            *w = A_CREATE_ABx(ins->t, a, sbx + A_MAXARG_sBx);
+        } break;
+    }
+    return 1;
 }
 
-A_State* A_newstate(const char *srcfile) {
-    A_State *as = NEW(A_State);
-    as->srcfile = srcfile;
-    as->src = load_file(srcfile);
+/* the opcode must be checked first */
+void A_decode(uint32_t w, A_Instr *ins) {
+    ins->t = A_GET_OP(w);
+    ins->a = A_GETARG_A(w);
+    const A_OpMode *om = &A_OpModes[ins->t];
+    switch (om->m) {
+        case iABC: {
+            int b = A_GETARG_B(w);
+            int c = A_GETARG_C(w);
+            if (om->b == OpArgK && A_ISK(b)) {
+                b = -A_INDEXK(b) - 1;
+            }
+            if (om->c == OpArgK && A_ISK(c)) {
+                c = -A_INDEXK(c) - 1;
+            }
+            ins->u.bc.b = b;
+            ins->u.bc.c = c;
+        } break;
 
-    as->funcs = list_new();
+        case iABx: {
+            int bx = A_GETARG_Bx(w);
+            ins->u.bx = om->b == OpArgK ? -bx - 1 : bx;
+        } break;
 
-    return as;
+        case iAsBx: {
+            ins->u.bx = A_GETARG_sBx(w);
+        } break;
+    }
 }
 
-void A_freestate(A_State *as) {
-    FREE(as->src);
-    FREE(as);
+/* what an identifier may be besides an opcode, looked up along with them */
+static const struct {
+    const char *s;
+    A_TokenType t;
+} _keywords[] = {
+    {"K", A_TT_CONST},
+    {"R", A_TT_REGCOUNT},
+    {"P", A_TT_PARAM},
+    {"F", A_TT_SUBFUNC},
+    {"FUNC", A_TT_FUNC},
+};
+
+#define A_NUM_KEYWORDS CAST(int, sizeof(_keywords) / sizeof(_keywords[0]))
+
+/* word w is opcode w, or keyword w - A_NUM_OPCODES */
+static const char* _wordname(int w) {
+    return w < A_NUM_OPCODES ? A_opnames[w] : _keywords[w - A_NUM_OPCODES].s;
 }
 
-static void _freetok(A_Token *t) {
-    if (t->t == A_TT_STRING) {
-        free(t->u.s); t->u.s = NULL;
+/* FNV-1a, folded so the low bits used as slot depend on all of it */
+static unsigned int _hashword(const char *s, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h = (h ^ CAST(unsigned char, s[i])) * 16777619u;
     }
-    t->t = A_TT_INVALID;
+    return h ^ (h >> 15);
 }
 
-static int _getopcode(const char *opname) {
-    for (int i = 0; A_opnames[i] != NULL; ++i) {
-        if (strcmp(opname, A_opnames[i]) == 0) {
-            return i;
+static void _initwords(A_State *as) {
+    for (int w = 0; w < A_NUM_OPCODES + A_NUM_KEYWORDS; ++w) {
+        const char *s = _wordname(w);
+        unsigned int h = _hashword(s, strlen(s));
+        while (as->words[h % A_WORDSLOTS] != 0) {
+            ++h;
         }
+        as->words[h % A_WORDSLOTS] = CAST(unsigned char, w + 1);
     }
-    return -1;
 }
 
-void A_cachetok(A_State *as) {
-    as->cached = 1;
+/* the word s[0..len) is, -1 if none */
+static int _findword(const A_State *as, const char *s, int len) {
+    for (unsigned int h = _hashword(s, len); ; ++h) {
+        int w = as->words[h % A_WORDSLOTS] - 1;
+        if (w < 0) {
+            return -1;
+        }
+        const char *ws = _wordname(w);
+        if (strncmp(ws, s, len) == 0 && ws[len] == '\0') {
+            return w;
+        }
+    }
 }
 
-A_TokenType A_nexttok(A_State *as) {
-    if (as->cached) {
-        as->cached = 0;
-        return as->curtok.t;
-    }
+#define A_SPILLSIZE (64 * 1024)
 
-    int maxidx = strlen(as->src);
-    if (as->curidx >= maxidx) {
-        return A_TT_EOT;
+/* room for `n' more bytes at the end */
+static void* _bufgrow(A_Buffer *b, size_t n) {
+    if (b->size + n > b->cap) {
+        b->cap = b->cap == 0 ? 256 : 2 * b->cap;
+        if (b->cap < b->size + n) {
+            b->cap = b->size + n;
+        }
+        b->data = realloc(b->data, b->cap);
     }
-    int ls = A_LS_INIT;
-    int begin = 0;
-    _freetok(&as->curtok);
-    for (;;) {
-        char c = as->src[as->curidx++];
-        switch (ls) {
-            case A_LS_INIT: {
-                if (c == '\0') {
-                    return A_TT_EOT;
-                }
+    void *p = b->data + b->size;
+    b->size += n;
+    return p;
+}
 
-                if (c == '\r' || isblank(c))  {
-                    break;
-                }
+/* append `n' bytes, return where they went */
+static uint32_t _bufadd(A_Buffer *b, const void *p, size_t n) {
+    size_t at = b->size;
+    if (n > 0) {
+        memcpy(_bufgrow(b, n), p, n);
+    }
+    return CAST(uint32_t, b->spilled + at);
+}
 
-                if (isdigit(c)) {
-                    begin = as->curidx - 1;
-                    ls = A_LS_INT;
-                    break;
-                }
+void* A_alloc(A_State *as, size_t size) {
+    size = (size + 7) & ~CAST(size_t, 7);   /* keeps Values, doubles and pointers aligned */
+    A_Block *b = as->arena;
+    if (b == NULL || b->size - b->used < size) {
+        size_t bsize = size > A_BLOCKSIZE ? size : A_BLOCKSIZE;
+        b = CAST(A_Block*, malloc(sizeof(A_Block) + bsize));
+        b->prev = as->arena;
+        b->size = bsize;
+        b->used = 0;
+        as->arena = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    memset(p, 0, size);
+    return p;
+}
 
-                if (c == '_' || isalpha(c)) {
-                    begin = as->curidx - 1;
-                    ls = A_LS_IDENT;
-                    break;
-                }
+/* what's in `b' moved to the arena */
+static void* _takebuf(A_State *as, A_Buffer *b) {
+    void *p = A_alloc(as, b->size);
+    if (b->size > 0) {
+        memcpy(p, b->data, b->size);
+    }
+    b->size = 0;
+    return p;
+}
 
-                if (c == '"') {
-                    begin = as->curidx;
-                    ls = A_LS_STR_HALF;
-                    break;
-                }
+static void _add_func(A_State *as, const char *name, int len) {
+    A_Func *f = A_alloc(as, sizeof(A_Func));
+    memcpy(f->name, name, len < MAX_NAME_LEN - 1 ? len : MAX_NAME_LEN - 1);
+    f->regcount = 2;    /* default */
+    as->fn = f;
+}
 
-                if (c == ';') {
-                    ls = A_LS_COMMENT;
-                    break;
-                }
+static A_Func* _closefunc(A_State *as) {
+    A_Func *fn = as->fn;
+    fn->consts.count = as->kbuf.size / sizeof(Value);
+    fn->consts.values = _takebuf(as, &as->kbuf);
+    fn->instrs.count = as->ibuf.size / sizeof(A_Instr);
+    fn->instrs.instrs = _takebuf(as, &as->ibuf);
+    fn->subfuncs.count = as->sbuf.size / sizeof(Value);
+    fn->subfuncs.values = _takebuf(as, &as->sbuf);
+    as->fn = NULL;
+    return fn;
+}
 
-                if (c == '+' || c == '-') {
-                    begin = as->curidx - 1;
-                    ls = A_LS_UNARY;
-                    break;
-                }
+/* keeping the last block, it's likely to be enough for the next function */
+void A_freefuncs(A_State *as) {
+    A_Block *b = as->arena;
+    if (b != NULL) {
+        while (b->prev != NULL) {
+            A_Block *prev = b->prev;
+            b->prev = prev->prev;
+            free(prev);
+        }
+        b->used = 0;
+    }
+    as->funcs.count = 0;
+    as->fn = NULL;
+}
 
-                if (c == ',') {as->curtok.t = A_TT_COMMA; return as->curtok.t;}
-                if (c == '\n') {as->curtok.t = A_TT_NEWLINE; ++as->curline; return as->curtok.t;}
-                if (c == '{') {as->curtok.t = A_TT_OPEN_BRACE; return as->curtok.t;}
-                if (c == '}') {as->curtok.t = A_TT_CLOSE_BRACE; return as->curtok.t;}
+A_State* A_newstate(const char *srcfile) {
+    A_State *as = NEW(A_State);
+    as->srcfile = srcfile;
+    as->srcf = fopen(srcfile, "rb");
+    if (as->srcf == NULL) {
+        error("Open %s failed: %s", srcfile, strerror(errno));
+    }
+    as->srccap = A_CHUNK;
+    as->src = NEW_SIZE(char, as->srccap + 1);
+    as->lastnl = -1;
+    as->curline = 1;
 
-                A_FATAL("invalid char `%c'", c);
-            } break;
+    as->strs = lstrtab_new(64);
+    _initwords(as);
 
-            case A_LS_UNARY: {
-                if (!isdigit(c)) {
-                    A_FATAL("number expected, got `%c'", c);
-                }
-                ls = A_LS_INT;
-            } break;
+    return as;
+}
 
-            case A_LS_INT: {
-                if (isdigit(c)) {
-                    break;
-                }
+void A_freestate(A_State *as) {
+    while (as->arena != NULL) {
+        A_Block *prev = as->arena->prev;
+        free(as->arena);
+        as->arena = prev;
+    }
+    FREE(as->funcs.funcs);
+    FREE(as->kbuf.data);
+    FREE(as->ibuf.data);
+    FREE(as->sbuf.data);
+    if (as->srcf != NULL) {
+        fclose(as->srcf);
+    }
+    lstrtab_free(as->strs);
+    if (!as->subsrc) {
+        FREE(as->src);
+    }
+    FREE(as);
+}
 
-                if (c == '.') {
-                    ls = A_LS_INTDOT;
-                    break;
-                }
+/*
+** Read on into the window, dropping what's before the line of curidx, so
+** errors can still show all of it. 0 if the source has no more.
+*/
+static int _fill(A_State *as) {
+    if (as->srcf == NULL) {
+        return 0;
+    }
+    int keep = as->curidx;
+    while (keep > 0 && as->src[keep - 1] != '\n') {
+        --keep;
+    }
+    memmove(as->src, as->src + keep, as->srclen - keep);
+    as->srclen -= keep;
+    as->curidx -= keep;
+    as->lastnl -= keep;
+    if (as->srccap - as->srclen < as->srccap / 2) {
+        as->srccap = 2 * as->srccap;    /* a long line */
+        as->src = realloc(as->src, as->srccap + 1);
+    }
 
-                if (c == ']' || c == ',' || c == ';' || isspace(c)) {
-                    --as->curidx;
-                    as->curtok.t = A_TT_INT;
-                    char *tmp = strndup(as->src + begin, as->curidx - begin);
-                    as->curtok.u.n = atoi(tmp);
-                    free(tmp);
-                    return A_TT_INT;
-                }
+    int want = as->srccap - as->srclen;
+    int n = fread(as->src + as->srclen, 1, want, as->srcf);
+    if (n < want) {
+        if (ferror(as->srcf)) {
+            error("Read %s failed: %s", as->srcfile, strerror(errno));
+        }
+        fclose(as->srcf); as->srcf = NULL;
+    }
+    for (int i = as->srclen + n - 1; i >= as->srclen; --i) {
+        if (as->src[i] == '\n') {
+            as->lastnl = i;
+            break;
+        }
+    }
+    as->srclen += n;
+    as->src[as->srclen] = '\0';
+    return n > 0;
+}
 
-                A_FATAL("unexpect char `%c'", c);
-            } break;
+void A_cachetok(A_State *as) {
+    as->cached = 1;
+}
 
-            case A_LS_INTDOT: {
-                if (isdigit(c)) {
-                    ls = A_LS_FLOAT;
-                    break;
-                }
-                A_FATAL("unexpect char `%c'", c);
-            } break;
+/* A_FATAL pointing at `at', the last char if it's the end */
+#define A_LEXFATAL(at, ...) \
+    as->curidx = CAST(int, (at) - as->src) + ((at) < as->src + as->srclen); A_FATAL(__VA_ARGS__)
 
-            case A_LS_FLOAT: {
-                if (isdigit(c)) {
-                    break;
-                }
-                
-                if (isspace(c)) {
-                    --as->curidx;
-                    as->curtok.t = A_TT_FLOAT;
-                    char *tmp = strndup(as->src + begin, as->curidx - begin);
-                    as->curtok.u.f = atof(tmp);
-                    free(tmp);
-                    return A_TT_FLOAT;
-                }
+/* [+-]123 or [+-]123.123, read in place */
+static const char* _lexnum(A_State *as, const char *p, const char *end) {
+    A_Token *tok = &as->curtok;
+    const char *begin = p;
+    if (*p == '+' || *p == '-') {
+        ++p;
+    }
+    if (p == end || !isdigit(CAST(unsigned char, *p))) {
+        A_LEXFATAL(p, "number expected, got `%c'", p == end ? ' ' : *p);
+    }
+    long long n = 0;
+    for (; p < end && isdigit(CAST(unsigned char, *p)); ++p) {
+        if (n <= INT_MAX) {
+            n = n * 10 + (*p - '0');
+        }
+    }
 
-                A_FATAL("unexpect char `%c'", c);
-            } break;
+    if (p < end && *p == '.') {
+        ++p;
+        if (p == end || !isdigit(CAST(unsigned char, *p))) {
+            A_LEXFATAL(p, "unexpect char `%c'", p == end ? ' ' : *p);
+        }
+        while (p < end && isdigit(CAST(unsigned char, *p))) {
+            ++p;
+        }
+        tok->t = A_TT_FLOAT;
+        tok->u.f = strtod(begin, NULL);
+    } else {
+        n = *begin == '-' ? -n : n;
+        if (n < INT_MIN || n > INT_MAX) {
+            A_LEXFATAL(p - 1, "integer out of range");
+        }
+        tok->t = A_TT_INT;
+        tok->u.n = CAST(int, n);
+    }
 
-            case A_LS_STR_HALF: {
-                if (c == '\0') {
-                    A_FATAL("unfinished string");
-                }
+    if (p < end && !(*p == ']' || *p == ',' || *p == ';' || isspace(CAST(unsigned char, *p)))) {
+        A_LEXFATAL(p, "unexpect char `%c'", *p);
+    }
+    return p;
+}
 
-                if (c == '\\') {
-                    ls = A_LS_STR_ESC;
-                    break;
-                }
-                if (c == '"') {
-                    as->curtok.t = A_TT_STRING;
-                    as->curtok.u.s = strndup(as->src + begin, as->curidx - begin - 1);
-                    return A_TT_STRING;
-                }
-            } break;
+/*
+** "abc", escapes are kept as they are. The only token that may go on past
+** its line, so it reads more by itself, counting from curidx which stays
+** on the same char.
+*/
+static const char* _lexstr(A_State *as, const char *p) {
+    int begin = CAST(int, p - as->src) - as->curidx + 1;
+    int i = begin;
+    for (;;) {
+        const char *s = as->src + as->curidx;
+        int n = as->srclen - as->curidx;
+        while (i < n && s[i] != '"') {
+            i += s[i] == '\\' ? 2 : 1;
+        }
+        if (i < n) {
+            break;
+        }
+        if (!_fill(as)) {
+            A_LEXFATAL(as->src + as->srclen, "unfinished string");
+        }
+    }
+    const char *s = as->src + as->curidx;
+    as->curtok.t = A_TT_STRING;
+    as->curtok.u.s.p = s + begin;
+    as->curtok.u.s.len = i - begin;
+    return s + i + 1;
+}
 
-            case A_LS_STR_ESC: {
-                ls = A_LS_STR_HALF;
-            } break;
+static const char* _lexword(A_State *as, const char *p, const char *end) {
+    A_Token *tok = &as->curtok;
+    const char *begin = p;
+    while (p < end && (*p == '_' || isalnum(CAST(unsigned char, *p)))) {
+        ++p;
+    }
+    int len = CAST(int, p - begin);
+    int w = _findword(as, begin, len);
+    if (w >= A_NUM_OPCODES) {
+        tok->t = _keywords[w - A_NUM_OPCODES].t;
+    } else if (w >= 0) {
+        tok->t = A_TT_INSTR;
+        tok->u.n = w;
+    } else {
+        tok->t = A_TT_IDENT;
+        tok->u.s.p = begin;
+        tok->u.s.len = len;
+    }
+    return p;
+}
 
-            case A_LS_IDENT: {
-                if (c != '_' && !isalnum(c)) {
-                    --as->curidx;
-
-                    _freetok(&as->curtok);
-
-                    char *tmp = strndup(as->src + begin, as->curidx - begin);
-                    if (strcmp(tmp, "K") == 0) {FREE(tmp); as->curtok.t = A_TT_CONST; return as->curtok.t;}
-                    if (strcmp(tmp, "R") == 0) {FREE(tmp); as->curtok.t = A_TT_REGCOUNT; return as->curtok.t;}
-                    if (strcmp(tmp, "P") == 0) {FREE(tmp); as->curtok.t = A_TT_PARAM; return as->curtok.t;}
-                    if (strcmp(tmp, "F") == 0) {FREE(tmp); as->curtok.t = A_TT_SUBFUNC; return as->curtok.t;}
-                    if (strcmp(tmp, "FUNC") == 0) {FREE(tmp); as->curtok.t = A_TT_FUNC; return as->curtok.t;}
-
-                    int oc = _getopcode(tmp);
-                    if (oc >= 0) {
-                        FREE(tmp);
-                        as->curtok.t = A_TT_INSTR;
-                        as->curtok.u.n = oc;
-                        return as->curtok.t;
-                    }
+A_TokenType A_nexttok(A_State *as) {
+    if (as->cached) {
+        as->cached = 0;
+        return as->curtok.t;
+    }
 
-                    as->curtok.t = A_TT_IDENT;
-                    as->curtok.u.s = tmp;
-                    return as->curtok.t;
-                }
-            } break;
+    /* any other token ends on its line, have all of it */
+    while (as->curidx > as->lastnl && _fill(as)) {}
 
-            case A_LS_COMMENT: {
-                if (c == '\n') {
-                    --as->curidx;
-                    ls = A_LS_INIT;
-                    break;
-                }
-            } break;
+    A_Token *tok = &as->curtok;
+    const char *p = as->src + as->curidx;
+    const char *end = as->src + as->srclen;
+    for (;;) {
+        while (p < end && (*p == '\r' || isblank(CAST(unsigned char, *p)))) {
+            ++p;
+        }
+        if (p < end && *p == ';') {
+            p = memchr(p, '\n', end - p);
+            p = p == NULL ? end : p;
+            continue;
+        }
+        break;
+    }
 
+    if (p == end) {
+        tok->t = A_TT_EOT;
+    } else if (isdigit(CAST(unsigned char, *p)) || *p == '+' || *p == '-') {
+        p = _lexnum(as, p, end);
+    } else if (*p == '_' || isalpha(CAST(unsigned char, *p))) {
+        p = _lexword(as, p, end);
+    } else if (*p == '"') {
+        p = _lexstr(as, p);
+    } else {
+        switch (*p++) {
+            case ',': {tok->t = A_TT_COMMA;} break;
+            case '{': {tok->t = A_TT_OPEN_BRACE;} break;
+            case '}': {tok->t = A_TT_CLOSE_BRACE;} break;
+            case '\n': {tok->t = A_TT_NEWLINE; ++as->curline;} break;
             default: {
-                A_FATAL("invalid state");
+                A_LEXFATAL(p - 1, "invalid char `%c'", p[-1]);
             } break;
         }
     }
+    as->curidx = CAST(int, p - as->src);
+    return tok->t;
 }
 
 void A_ptok(const A_Token *tok) {
@@ -347,7 +575,7 @@ void A_ptok(const A_Token *tok) {
             printf("<F:%lf> ", tok->u.f);
         } break;
         case A_TT_STRING: {
-            printf("<S:%s> ", tok->u.s);
+            printf("<S:%.*s> ", tok->u.s.len, tok->u.s.p);
         } break;
         case A_TT_COMMA: {
             printf("<,> ");
@@ -373,13 +601,6 @@ void A_ptok(const A_Token *tok) {
     }
 }
 
-static void _resetstate(A_State *as) {
-    as->curline = 1;
-    as->curidx = 0;
-    as->curfunc = 0;
-    _freetok(&as->curtok);
-}
-
 static const char *_toknames[] = {
     "INVALID",
     "INT",
@@ -390,7 +611,9 @@ static const char *_toknames[] = {
     "}",
     "NEWLINE",
     "CONST",
+    "PARAM",
     "REGCOUNT",
+    "SUBFUNC",
     "FUNC",
     "INSTR",     /* instruction */
     "IDENT",
@@ -398,61 +621,49 @@ static const char *_toknames[] = {
 };
 
 static A_Func* _get_curfunc(const A_State *as) {
-    if (as->curfunc == 0) {
+    if (as->fn == NULL) {
         A_FATAL("not in function scope");
     }
-    if (as->curfunc > as->funcs->count) {
-        A_FATAL("function idx overflow: %d of %d", as->curfunc, as->funcs->count);
-    }
-    lnode *n = as->funcs->head;
-    for (int i = 0; i < as->curfunc - 1; ++i) {
-        n = n->next;
-    }
-    return CAST(A_Func*, n->data);
+    return as->fn;
 }
 
 static void _parse_subfunc(A_State *as) {
     expect(A_TT_INT);
-    
-    Value *v = NEW(Value);
-    v->t = VT_INT;
-    v->u.n = as->curtok.u.n;
 
-    A_Func *fn = _get_curfunc(as);
-    list_pushback(fn->subfuncs, v);
+    _get_curfunc(as);
+    Value v;
+    SET_INT(&v, as->curtok.u.n);
+    _bufadd(&as->sbuf, &v, sizeof(v));
 
     expect(A_TT_NEWLINE);
 }
 
 static void _parse_const(A_State *as) {
     A_TokenType kt = A_nexttok(as);
-    Value *k = NEW(Value);
+    Value k;
+    SET_NIL(&k);
     if (kt == A_TT_INT) {
-        k->t = VT_INT;
-        k->u.n = as->curtok.u.n;
+        SET_INT(&k, as->curtok.u.n);
     } else if (kt == A_TT_FLOAT) {
-        k->t = VT_FLOAT;
-        k->u.f = as->curtok.u.f;
+        SET_FLOAT(&k, as->curtok.u.f);
     } else if (kt == A_TT_STRING) {
-        k->t = VT_STRING;
-        k->u.s = strdup(as->curtok.u.s);
+        SET_STR(&k, lstring_new(as->strs, as->curtok.u.s.p, as->curtok.u.s.len));
     } else {
-        FREE(k);
         A_FATAL("const can only be int, float and string");
     }
 
-    A_Func *fn = _get_curfunc(as);
-    list_pushback(fn->consts, k);
+    _get_curfunc(as);
+    _bufadd(&as->kbuf, &k, sizeof(k));
 
     expect(A_TT_NEWLINE);
 }
 
 static void _parse_func(A_State *as) {
-    if (as->curfunc != 0) {
+    if (as->fn != NULL) {
         A_FATAL("nested function is not allowed");
     }
     expect(A_TT_IDENT);
-    _add_func(as, as->curtok.u.s);
+    _add_func(as, as->curtok.u.s.p, as->curtok.u.s.len);
     expect(A_TT_OPEN_BRACE);
 }
 
@@ -485,9 +696,11 @@ static void _parse_instr(A_State *as) {
 
     expect(A_TT_NEWLINE);
 
-    A_Instr *ins = NEW(A_Instr);
+    _get_curfunc(as);
+    A_Instr *ins = _bufgrow(&as->ibuf, sizeof(A_Instr));
+    memset(ins, 0, sizeof(*ins));
     ins->t = oc;
-    ins->a = CAST(char, a);
+    ins->a = CAST(short, a);
     switch (om->m) {
         case iABC: {
             ins->u.bc.b = CAST(short, b);
@@ -499,9 +712,6 @@ static void _parse_instr(A_State *as) {
             ins->u.bx = b;
         } break;
     }
-
-    A_Func *fn = _get_curfunc(as);
-    list_pushback(fn->instrs, ins);
 }
 
 static void _parse_param(A_State *as) {
@@ -522,31 +732,44 @@ static void _parse_regcount(A_State *as) {
     expect(A_TT_NEWLINE);
 }
 
-void A_parse(A_State *as) {
-    _resetstate(as);
-
+A_Func* A_parsefunc(A_State *as) {
     for (;;) {
         A_TokenType tt = A_nexttok(as);
         switch (tt) {
             case A_TT_FUNC: {_parse_func(as);} break;
             case A_TT_CLOSE_BRACE: {
-                if (as->curfunc == 0) {
+                if (as->fn == NULL) {
                     A_FATAL("unexpected `}'");
                 }
-                as->curfunc = 0;
-            } break;
+                return _closefunc(as);
+            }
             case A_TT_CONST: {_parse_const(as);} break;
             case A_TT_SUBFUNC: {_parse_subfunc(as);} break;
             case A_TT_INSTR: {_parse_instr(as);} break;
             case A_TT_PARAM: {_parse_param(as);} break;
             case A_TT_REGCOUNT: {_parse_regcount(as);} break;
             case A_TT_NEWLINE: {} break;
-            case A_TT_EOT: {return;}
+            case A_TT_EOT: {
+                /* an unclosed last function is taken as it is */
+                return as->fn == NULL ? NULL : _closefunc(as);
+            }
             default: {A_FATAL("unexpected token");} break;
         }
     }
 }
 
+void A_parse(A_State *as) {
+    A_Func *fn;
+    while ((fn = A_parsefunc(as)) != NULL) {
+        A_FuncStream *fs = &as->funcs;
+        if (fs->count == fs->size) {
+            fs->size = fs->size == 0 ? 16 : 2 * fs->size;
+            fs->funcs = realloc(fs->funcs, fs->size * sizeof(A_Func*));
+        }
+        fs->funcs[fs->count++] = fn;
+    }
+}
+
 /*==================================================
 HEADER:
     "LUNA" (4 bytes)
@@ -585,7 +808,7 @@ FUNCTIONS:
             }
     }
 ==================================================*/
-void A_createbin(const A_State *as, const char *outfile) { 
+void A_createbin_v1(const A_State *as, const char *outfile) {
     FILE *f = fopen(outfile, "wb");
     if (f == NULL) {
         perror("");
@@ -602,9 +825,9 @@ void A_createbin(const A_State *as, const char *outfile) {
     fwrite(&num, 2, 1, f);
 
     /* FUNCTIONS */
-    fwrite(&as->funcs->count, 4, 1, f);
-    for (const lnode *n = as->funcs->head; n != NULL; n = n->next) {
-        const A_Func *fn = CAST(const A_Func*, n->data);
+    fwrite(&as->funcs.count, 4, 1, f);
+    for (int i = 0; i < as->funcs.count; ++i) {
+        const A_Func *fn = as->funcs.funcs[i];
 
         /* NAME */
         int namelen = strlen(fn->name);
@@ -621,34 +844,37 @@ void A_createbin(const A_State *as, const char *outfile) {
         fwrite(&fn->regcount, 2, 1, f);
 
         /* CONSTS */
-        fwrite(&fn->consts->count, 4, 1, f);
-        for (lnode *n = fn->consts->head; n != NULL; n = n->next) {
-            Value *k = CAST(Value*, n->data);
-            fwrite(&k->t, 1, 1, f);
-            if (k->t == VT_INT) {
-                fwrite(&k->u.n, 4, 1, f);
-            } else if (k->t == VT_FLOAT) {
-                fwrite(&k->u.f, 4, 1, f);
-            } else if (k->t == VT_STRING) {
-                int len = strlen(k->u.s);
-                fwrite(&len, 4, 1, f);
-                fwrite(k->u.s, 1, len, f);
+        fwrite(&fn->consts.count, 4, 1, f);
+        for (int j = 0; j < fn->consts.count; ++j) {
+            const Value *k = &fn->consts.values[j];
+            unsigned char t = VAL_TYPE(k);
+            fwrite(&t, 1, 1, f);
+            if (t == VT_INT) {
+                int num = VAL_INT(k);
+                fwrite(&num, 4, 1, f);
+            } else if (t == VT_FLOAT) {
+                double d = VAL_FLOAT(k);
+                fwrite(&d, 4, 1, f);
+            } else if (t == VT_STRING) {
+                const LString *ls = VAL_STR(k);
+                fwrite(&ls->len, 4, 1, f);
+                fwrite(ls->s, 1, ls->len, f);
             } else {
-                error("unexpected const type: %d", k->t);
+                error("unexpected const type: %d", t);
             }
         }
 
         /* SUBFUNCS */
-        fwrite(&fn->subfuncs->count, 4, 1, f);
-        for (lnode *n = fn->subfuncs->head; n != NULL; n = n->next) {
-            Value *v = CAST(Value*, n->data);
-            fwrite(&v->u.n, 4, 1, f);
+        fwrite(&fn->subfuncs.count, 4, 1, f);
+        for (int j = 0; j < fn->subfuncs.count; ++j) {
+            int fnidx = VAL_INT(&fn->subfuncs.values[j]);
+            fwrite(&fnidx, 4, 1, f);
         }
 
         /* INSTRUCTIONS */
-        fwrite(&fn->instrs->count, 4, 1, f);
-        for (lnode *n = fn->instrs->head; n != NULL; n = n->next) {
-            A_Instr *instr = CAST(A_Instr*, n->data);
+        fwrite(&fn->instrs.count, 4, 1, f);
+        for (int j = 0; j < fn->instrs.count; ++j) {
+            const A_Instr *instr = &fn->instrs.instrs[j];
             const A_OpMode *om = &A_OpModes[instr->t];
             fwrite(&instr->t, 1, 1, f);
             if (om->a != OpArgN) {
@@ -677,3 +903,383 @@ void A_createbin(const A_State *as, const char *outfile) {
     fclose(f); f = NULL;
 }
 
+static size_t _bufsize(const A_Buffer *b) {
+    return b->spilled + b->size;
+}
+
+/* out of memory into a temporary file, once there's enough of it */
+static void _bufspill(A_Buffer *b) {
+    if (b->size < A_SPILLSIZE) {
+        return;
+    }
+    if (b->spill == NULL && (b->spill = tmpfile()) == NULL) {
+        error("tmpfile failed: %s", strerror(errno));
+    }
+    if (fwrite(b->data, 1, b->size, b->spill) != b->size) {
+        error("spill failed: %s", strerror(errno));
+    }
+    b->spilled += b->size;
+    b->size = 0;
+}
+
+static void _bufwrite(A_Buffer *b, FILE *f) {
+    if (b->spill != NULL) {
+        char chunk[8192];
+        size_t n;
+        rewind(b->spill);
+        while ((n = fread(chunk, 1, sizeof(chunk), b->spill)) > 0) {
+            fwrite(chunk, 1, n, f);
+        }
+        fclose(b->spill); b->spill = NULL;
+    }
+    if (b->size > 0) {
+        fwrite(b->data, 1, b->size, f);
+    }
+    FREE(b->data);
+}
+
+/*
+** Pools of a v3 module: each distinct string goes in STRS once and each
+** distinct constant in CONSTS once, found again through `stroffs' (string
+** to offset) and the open addressed `kslots'. Those stay in memory, the
+** sections only added to function by function are spilled as they grow.
+*/
+struct A_Bin {
+    A_Buffer secs[B_NUM_SECS];
+    ltable *stroffs;
+    uint32_t *kslots;   /* 1 + index in CONSTS, 0: free */
+    int ksize;          /* 0 or a power of 2 */
+    int kcount;
+};
+
+static uint32_t _addstr(A_Bin *ab, LString *ls) {
+    const Value *off = ltable_getstr(ab->stroffs, ls);
+    if (off != NULL) {
+        return CAST(uint32_t, VAL_INT(off));
+    }
+    uint32_t at = _bufadd(&ab->secs[B_SEC_STRS], ls->s, ls->len);
+    _bufadd(&ab->secs[B_SEC_STRS], "", 1);
+    Value key, v;
+    SET_STR(&key, ls);
+    SET_INT(&v, CAST(int, at));
+    ltable_set(ab->stroffs, &key, &v);
+    return at;
+}
+
+/* FNV-1a over the whole entry, which has no padding left uninitialized */
+static unsigned int _hashconst(const B_Const *bk) {
+    const unsigned char *p = CAST(const unsigned char*, bk);
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < sizeof(*bk); ++i) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void _growconsts(A_Bin *ab) {
+    int size = ab->ksize == 0 ? 64 : 2 * ab->ksize;
+    uint32_t *slots = NEW_ARRAY(uint32_t, size);
+    const B_Const *ks = CAST(const B_Const*, ab->secs[B_SEC_CONSTS].data);
+    for (int k = 0; k < ab->kcount; ++k) {
+        unsigned int i = _hashconst(&ks[k]) & (size - 1);
+        while (slots[i] != 0) {
+            i = (i + 1) & (size - 1);
+        }
+        slots[i] = k + 1;
+    }
+    FREE(ab->kslots);
+    ab->kslots = slots;
+    ab->ksize = size;
+}
+
+/* index in CONSTS of `bk', added if it isn't there yet */
+static uint32_t _addconst(A_Bin *ab, const B_Const *bk) {
+    if (2 * (ab->kcount + 1) > ab->ksize) {
+        _growconsts(ab);
+    }
+    const B_Const *ks = CAST(const B_Const*, ab->secs[B_SEC_CONSTS].data);
+    unsigned int mask = ab->ksize - 1;
+    for (unsigned int i = _hashconst(bk) & mask; ; i = (i + 1) & mask) {
+        uint32_t slot = ab->kslots[i];
+        if (slot == 0) {
+            _bufadd(&ab->secs[B_SEC_CONSTS], bk, sizeof(*bk));
+            ab->kslots[i] = ++ab->kcount;
+            return ab->kcount - 1;
+        }
+        if (memcmp(&ks[slot - 1], bk, sizeof(*bk)) == 0) {
+            return slot - 1;
+        }
+    }
+}
+
+static void _encodefunc(const A_Func *fn, uint32_t *code) {
+    for (int pc = 0; pc < fn->instrs.count; ++pc) {
+        const A_Instr *ins = &fn->instrs.instrs[pc];
+        if (!A_encode(ins, &code[pc])) {
+            error("%s: operands of %s at %d don't fit in 32 bits", fn->name, A_opnames[ins->t], pc);
+        }
+    }
+}
+
+A_Bin* A_newbin(void) {
+    A_Bin *ab = NEW(A_Bin);
+    ab->stroffs = ltable_new(0, 0);
+    return ab;
+}
+
+/* appends `fn', which may be freed right after, strings go in as->strs */
+void A_binfunc(A_Bin *ab, const A_State *as, const A_Func *fn) {
+    A_Buffer *secs = ab->secs;
+    B_Func bf;
+    memset(&bf, 0, sizeof(bf));
+    bf.name = _addstr(ab, lstring_new(as->strs, fn->name, strlen(fn->name)));
+    bf.param = fn->param;
+    bf.regcount = fn->regcount;
+
+    bf.kfirst = _bufsize(&secs[B_SEC_KREFS]) / sizeof(uint32_t);
+    bf.kcount = fn->consts.count;
+    for (int i = 0; i < fn->consts.count; ++i) {
+        const Value *k = &fn->consts.values[i];
+        B_Const bk;
+        memset(&bk, 0, sizeof(bk));
+        bk.type = VAL_TYPE(k);
+        switch (VAL_TYPE(k)) {
+            case VT_INT: {bk.u.n = VAL_INT(k);} break;
+            case VT_FLOAT: {bk.u.f = VAL_FLOAT(k);} break;
+            case VT_STRING: {
+                /* it may be in the table of an A_parallel thread */
+                LString *ls = lstring_new(as->strs, VAL_STR(k)->s, VAL_STR(k)->len);
+                bk.len = ls->len;
+                bk.u.str = _addstr(ab, ls);
+            } break;
+            default: {error("unexpected const type: %d", VAL_TYPE(k));} break;
+        }
+        uint32_t idx = _addconst(ab, &bk);
+        _bufadd(&secs[B_SEC_KREFS], &idx, sizeof(idx));
+    }
+
+    bf.sfirst = _bufsize(&secs[B_SEC_SUBFS]) / sizeof(uint32_t);
+    bf.scount = fn->subfuncs.count;
+    for (int i = 0; i < fn->subfuncs.count; ++i) {
+        uint32_t fnidx = VAL_INT(&fn->subfuncs.values[i]);
+        _bufadd(&secs[B_SEC_SUBFS], &fnidx, sizeof(fnidx));
+    }
+
+    bf.codefirst = _bufsize(&secs[B_SEC_CODE]) / sizeof(uint32_t);
+    bf.codecount = fn->instrs.count;
+    if (fn->code != NULL) {
+        _bufadd(&secs[B_SEC_CODE], fn->code, bf.codecount * sizeof(uint32_t));
+    } else {
+        _encodefunc(fn, _bufgrow(&secs[B_SEC_CODE], bf.codecount * sizeof(uint32_t)));
+    }
+
+    _bufadd(&secs[B_SEC_FUNCS], &bf, sizeof(bf));
+
+    _bufspill(&secs[B_SEC_FUNCS]);
+    _bufspill(&secs[B_SEC_SUBFS]);
+    _bufspill(&secs[B_SEC_CODE]);
+    _bufspill(&secs[B_SEC_KREFS]);
+}
+
+/* .lbin v3, see lbin.h */
+void A_closebin(A_Bin *ab, const char *outfile) {
+    A_Buffer *secs = ab->secs;
+    B_Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.ident, "LUNA", 4);
+    h.major = A_VER_MAJOR;
+    h.minor = A_VER_MINOR;
+    h.version = B_VERSION;
+    h.nsections = B_NUM_SECS;
+
+    B_Section table[B_NUM_SECS];
+    memset(table, 0, sizeof(table));
+    size_t offset = sizeof(h) + sizeof(table);
+    for (int i = 0; i < B_NUM_SECS; ++i) {
+        offset = (offset + B_ALIGN - 1) / B_ALIGN * B_ALIGN;
+        table[i].id = i;
+        table[i].offset = offset;
+        table[i].size = _bufsize(&secs[i]);
+        offset += table[i].size;
+    }
+
+    FILE *f = fopen(outfile, "wb");
+    if (f == NULL) {
+        error("Open %s failed: %s", outfile, strerror(errno));
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(table, sizeof(table), 1, f);
+    static const char zeros[B_ALIGN] = {0};
+    for (int i = 0; i < B_NUM_SECS; ++i) {
+        long pos = ftell(f);
+        fwrite(zeros, 1, table[i].offset - pos, f);
+        _bufwrite(&secs[i], f);
+    }
+    fclose(f); f = NULL;
+    ltable_free(ab->stroffs);
+    FREE(ab->kslots);
+    FREE(ab);
+}
+
+#define A_JOBSIZE (64 * 1024)   /* bytes of source a thread takes at least */
+
+/* a run of whole functions */
+typedef struct {
+    A_State *as;    /* over just the run, its funcs once parsed */
+    int done;
+} A_Job;
+
+typedef struct {
+    A_Job *jobs;
+    int njobs;
+    int next;   /* to be taken */
+    int limit;  /* no further than this ahead of the writer, to bound memory */
+    A_FuncHook hook;
+    void *ud;
+    pthread_mutex_t lock;
+    pthread_cond_t doneone;
+    pthread_cond_t wrote;
+} A_Pool;
+
+static A_State* _substate(const A_State *as, int begin, int end, int line) {
+    A_State *sub = NEW(A_State);
+    sub->srcfile = as->srcfile;
+    sub->src = as->src + begin;
+    sub->srclen = end - begin;
+    sub->lastnl = sub->srclen;  /* all there, never filled */
+    sub->subsrc = 1;
+    sub->curline = line;
+    sub->strs = lstrtab_new(64);
+    memcpy(sub->words, as->words, sizeof(as->words));
+    return sub;
+}
+
+static void _addjob(const A_State *as, A_Job **jobs, int *count, int begin, int end, int line) {
+    if ((*count & (*count - 1)) == 0) {
+        *jobs = realloc(*jobs, (*count == 0 ? 1 : 2 * *count) * sizeof(A_Job));
+    }
+    A_Job *job = &(*jobs)[(*count)++];
+    job->as = _substate(as, begin, end, line);
+    job->done = 0;
+}
+
+/*
+** Cut the source after a `}' outside of strings and comments, where a
+** function ends, into runs of at least A_JOBSIZE bytes. Lines are counted
+** as the lexer does, which doesn't in strings.
+*/
+static int _split(const A_State *as, A_Job **jobs) {
+    const char *src = as->src;
+    int n = as->srclen;
+    int count = 0;
+    int begin = 0;
+    int beginline = 1;
+    int line = 1;
+    *jobs = NULL;
+    for (int i = 0; i < n; ++i) {
+        i += strcspn(src + i, "\n;\"}");    /* stops at a '\0' in the source too */
+        switch (src[i]) {
+            case '\n': {++line;} break;
+            case ';': {
+                const char *nl = memchr(src + i, '\n', n - i);
+                i = nl == NULL ? n : CAST(int, nl - src) - 1;
+            } break;
+            case '"': {
+                for (++i; i < n && src[i] != '"'; ++i) {
+                    i += src[i] == '\\';
+                }
+            } break;
+            case '}': {
+                if (i + 1 - begin >= A_JOBSIZE) {
+                    _addjob(as, jobs, &count, begin, i + 1, beginline);
+                    begin = i + 1;
+                    beginline = line;
+                }
+            } break;
+        }
+    }
+    if (begin < n) {
+        _addjob(as, jobs, &count, begin, n, beginline);
+    }
+    return count;
+}
+
+static void* _worker(void *arg) {
+    A_Pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next >= pool->limit && pool->next < pool->njobs) {
+            pthread_cond_wait(&pool->wrote, &pool->lock);
+        }
+        int j = pool->next < pool->njobs ? pool->next++ : -1;
+        pthread_mutex_unlock(&pool->lock);
+        if (j < 0) {
+            return NULL;
+        }
+
+        A_Job *job = &pool->jobs[j];
+        A_parse(job->as);
+        for (int i = 0; i < job->as->funcs.count; ++i) {
+            A_Func *fn = job->as->funcs.funcs[i];
+            if (pool->hook != NULL) {
+                pool->hook(job->as, fn, pool->ud);
+            }
+            fn->code = A_alloc(job->as, fn->instrs.count * sizeof(uint32_t));
+            _encodefunc(fn, fn->code);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->doneone);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void A_parallel(A_State *as, A_Bin *ab, int nthreads, A_FuncHook hook, void *ud) {
+    while (_fill(as)) {}
+
+    A_Pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.njobs = _split(as, &pool.jobs);
+    pool.hook = hook;
+    pool.ud = ud;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.doneone, NULL);
+    pthread_cond_init(&pool.wrote, NULL);
+
+    if (nthreads > pool.njobs) {
+        nthreads = pool.njobs;
+    }
+    pool.limit = 2 * nthreads;
+    pthread_t *threads = NEW_ARRAY(pthread_t, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, _worker, &pool) != 0) {
+            error("pthread_create failed");
+        }
+    }
+
+    /* in order, as each run is done */
+    for (int j = 0; j < pool.njobs; ++j) {
+        A_Job *job = &pool.jobs[j];
+        pthread_mutex_lock(&pool.lock);
+        while (!job->done) {
+            pthread_cond_wait(&pool.doneone, &pool.lock);
+        }
+        ++pool.limit;
+        pthread_cond_broadcast(&pool.wrote);
+        pthread_mutex_unlock(&pool.lock);
+        for (int i = 0; i < job->as->funcs.count; ++i) {
+            A_binfunc(ab, as, job->as->funcs.funcs[i]);
+        }
+        A_freestate(job->as); job->as = NULL;
+    }
+
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    FREE(threads);
+    FREE(pool.jobs);
+    pthread_cond_destroy(&pool.doneone);
+    pthread_cond_destroy(&pool.wrote);
+    pthread_mutex_destroy(&pool.lock);
+}
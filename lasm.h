@@ -1,8 +1,8 @@
 #ifndef lasm_h
 #define lasm_h
 
-#include "list.h"
 #include "ltable.h"
+#include "lstring.h"
 
 #define A_VER_MAJOR 5
 #define A_VER_MINOR 1
@@ -92,6 +92,8 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx], R(A), ... ,R(A+n))	*/
 OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
 } A_OpCode;
 
+#define A_NUM_OPCODES (CAST(int, OP_VARARG) + 1)
+
 typedef enum {
     A_TT_INVALID,
     A_TT_INT,
@@ -116,7 +118,7 @@ typedef struct {
     union {
         int n;
         double f;
-        char *s;
+        struct {const char *p; int len;} s;   /* STRING and IDENT, right in the source */
     } u;
 } A_Token;
 
@@ -129,36 +131,159 @@ typedef struct {
     } u;
 } A_Instr;
 
+/*
+** Instructions of .lbin v2 are 32 bit words laid out as in Lua 5.1:
+**     | B:9 | C:9 | A:8 | op:6 |    or    | Bx:18 | A:8 | op:6 |
+** An RK operand with A_BITRK set is constant A_INDEXK(x), Bx of LOADK,
+** GETGLOBAL and SETGLOBAL is a constant index, sBx is stored as
+** sBx + A_MAXARG_sBx. A_encode/A_decode convert from/to A_Instr, where
+** constants are negative (-1 is the first one).
+*/
+#define A_SIZE_OP 6
+#define A_SIZE_A 8
+#define A_SIZE_B 9
+#define A_SIZE_C 9
+#define A_SIZE_Bx (A_SIZE_B + A_SIZE_C)
+
+#define A_POS_OP 0
+#define A_POS_A (A_POS_OP + A_SIZE_OP)
+#define A_POS_C (A_POS_A + A_SIZE_A)
+#define A_POS_B (A_POS_C + A_SIZE_C)
+#define A_POS_Bx A_POS_C
+
+#define A_MAXARG_A ((1 << A_SIZE_A) - 1)
+#define A_MAXARG_B ((1 << A_SIZE_B) - 1)
+#define A_MAXARG_C ((1 << A_SIZE_C) - 1)
+#define A_MAXARG_Bx ((1 << A_SIZE_Bx) - 1)
+#define A_MAXARG_sBx (A_MAXARG_Bx >> 1)
+
+#define A_BITRK (1 << (A_SIZE_B - 1))
+#define A_MAXINDEXRK (A_BITRK - 1)
+#define A_ISK(x) ((x) & A_BITRK)
+#define A_INDEXK(x) ((x) & ~A_BITRK)
+#define A_RKASK(x) ((x) | A_BITRK)
+
+#define A_MASK1(n, p) ((~((~CAST(uint32_t, 0)) << (n))) << (p))
+
+#define A_GET_OP(i) (CAST(int, ((i) >> A_POS_OP) & A_MASK1(A_SIZE_OP, 0)))
+#define A_SET_OP(i, o) ((i) = ((i) & ~A_MASK1(A_SIZE_OP, A_POS_OP)) | (CAST(uint32_t, o) << A_POS_OP))
+#define A_GETARG_A(i) (CAST(int, ((i) >> A_POS_A) & A_MASK1(A_SIZE_A, 0)))
+#define A_GETARG_B(i) (CAST(int, ((i) >> A_POS_B) & A_MASK1(A_SIZE_B, 0)))
+#define A_GETARG_C(i) (CAST(int, ((i) >> A_POS_C) & A_MASK1(A_SIZE_C, 0)))
+#define A_GETARG_Bx(i) (CAST(int, ((i) >> A_POS_Bx) & A_MASK1(A_SIZE_Bx, 0)))
+#define A_GETARG_sBx(i) (A_GETARG_Bx(i) - A_MAXARG_sBx)
+
+#define A_CREATE_ABC(o, a, b, c) ((CAST(uint32_t, o) << A_POS_OP)\
+    | (CAST(uint32_t, a) << A_POS_A)\
+    | (CAST(uint32_t, b) << A_POS_B)\
+    | (CAST(uint32_t, c) << A_POS_C))
+#define A_CREATE_ABx(o, a, bx) ((CAST(uint32_t, o) << A_POS_OP)\
+    | (CAST(uint32_t, a) << A_POS_A)\
+    | (CAST(uint32_t, bx) << A_POS_Bx))
+
+int A_encode(const A_Instr *ins, uint32_t *w);   /* 0 if an operand doesn't fit */
+void A_decode(uint32_t w, A_Instr *ins);
+
+typedef struct {
+    int count;
+    Value *values;
+} A_ValueStream;
+
+typedef struct {
+    int count;
+    A_Instr *instrs;
+} A_InstrStream;
+
+/* the arrays are in the arena of the A_State it was parsed by */
 typedef struct {
     char name[MAX_NAME_LEN];
     int param;
     int regcount;
-    list *consts;
-    list *instrs;
-    list *subfuncs;
+    A_ValueStream consts;
+    A_InstrStream instrs;
+    A_ValueStream subfuncs; /* fnidx as ints */
+    uint32_t *code;     /* instrs encoded ahead by an A_parallel thread, or NULL */
 } A_Func;
 
+typedef struct {
+    int size;
+    int count;
+    A_Func **funcs;
+} A_FuncStream;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t cap;
+    FILE *spill;    /* the `spilled' bytes before data, NULL if none */
+    size_t spilled;
+} A_Buffer;
+
+/* of the bump allocator of an A_State */
+typedef struct A_Block {
+    struct A_Block *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} A_Block;
+
+#define A_BLOCKSIZE (64 * 1024)
+
+#define A_WORDSLOTS 128 /* opcodes and keywords hashed by the lexer */
+#define A_CHUNK (64 * 1024) /* bytes of source read at a time */
+
 typedef struct {
     const char *srcfile;
-    char *src;
+    FILE *srcf;     /* NULL once read to the end */
+    char *src;      /* window on the source from the line being lexed, '\0' terminated */
+    int srclen;
+    int srccap;
+    int lastnl;     /* of the last '\n' in src, -1 if none */
+    unsigned char subsrc;   /* src is a run of another state's, see A_parallel */
     int curline;
     int curidx;
 
-    list *funcs;
-    int curfunc;    /* 0: in global scope */
+    A_FuncStream funcs; /* filled by A_parse */
+    A_Func *fn;     /* being parsed, NULL: in global scope */
+    A_Buffer kbuf;  /* consts, instrs and subfuncs of fn until it's closed */
+    A_Buffer ibuf;
+    A_Buffer sbuf;
+    A_Block *arena; /* functions and their arrays, all freed at once */
+    lstrtab *strs;  /* string constants */
 
     unsigned char cached;
     A_Token curtok;
+    unsigned char words[A_WORDSLOTS];  /* 1 + word index, 0: free */
 } A_State;
 
+/* a .lbin v3 being written, one function after the other */
+typedef struct A_Bin A_Bin;
+
 A_State* A_newstate(const char *srcfile);
 void A_freestate(A_State *as);
 
 A_TokenType A_nexttok(A_State *as);
 void A_cachetok(A_State *as);
 
-void A_parse(A_State *as);
-void A_createbin(const A_State *as, const char *outfile);
+void* A_alloc(A_State *as, size_t size);   /* zeroed, from the arena */
+
+A_Func* A_parsefunc(A_State *as);  /* the next one, NULL at the end of the source */
+void A_parse(A_State *as);      /* all of them into as->funcs */
+void A_freefuncs(A_State *as);  /* all parsed so far, the arena is reused */
+
+/*
+** The whole source is read and split into runs of functions, each parsed
+** on one of `nthreads' threads, which also passes every function to `hook'.
+** They are added to `ab' in source order, the same .lbin as A_parsefunc
+** and A_binfunc one by one.
+*/
+typedef void (*A_FuncHook)(A_State *as, A_Func *fn, void *ud);
+void A_parallel(A_State *as, A_Bin *ab, int nthreads, A_FuncHook hook, void *ud);
+
+A_Bin* A_newbin(void);
+void A_binfunc(A_Bin *ab, const A_State *as, const A_Func *fn);
+void A_closebin(A_Bin *ab, const char *outfile);    /* writes the file and frees ab */
+void A_createbin_v1(const A_State *as, const char *outfile);
 
 void A_ptok(const A_Token *tok);
 
@@ -0,0 +1,73 @@
+#ifndef lbin_h
+#define lbin_h
+
+#include "luna.h"
+
+/*
+** Layout of a .lbin v2/v3 file. A v1 file has its function count where
+** B_Header.zero is, and that count is never 0.
+**
+**     B_Header
+**     B_Section[nsections]
+**     sections, each aligned to B_ALIGN bytes
+**
+** Section offsets are from the start of the file. Functions refer to
+** their subfunctions and code by index in the matching section, and to
+** strings by byte offset in the string pool. Since v3 constants and
+** strings are shared by the whole module, each distinct one stored once:
+** kfirst/kcount of a function is a run of KREFS, indexes in CONSTS. In
+** v2 there's no KREFS and the run is in CONSTS itself.
+*/
+#define B_VERSION 3
+#define B_ALIGN 8
+
+typedef enum {
+    B_SEC_STRS,     /* string pool, every string is '\0' terminated */
+    B_SEC_FUNCS,    /* B_Func[] */
+    B_SEC_CONSTS,   /* B_Const[] */
+    B_SEC_SUBFS,    /* uint32_t[], fnidx of subfunctions */
+    B_SEC_CODE,     /* uint32_t[], encoded instructions (see lasm.h) */
+    B_SEC_KREFS,    /* uint32_t[], constants of the functions by index in CONSTS */
+    B_NUM_SECS,
+} B_SectionId;
+
+typedef struct {
+    char ident[4];  /* "LUNA" */
+    uint16_t major;
+    uint16_t minor;
+    uint32_t zero;
+    uint32_t version;
+    uint32_t nsections;
+    uint32_t reserved;
+} B_Header;
+
+typedef struct {
+    uint32_t id;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} B_Section;
+
+typedef struct {
+    uint32_t name;  /* in STRS */
+    uint16_t param;
+    uint16_t regcount;
+    uint32_t kfirst;
+    uint32_t kcount;
+    uint32_t sfirst;
+    uint32_t scount;
+    uint32_t codefirst;
+    uint32_t codecount;
+} B_Func;
+
+typedef struct {
+    uint32_t type;  /* VT_INT, VT_FLOAT or VT_STRING */
+    uint32_t len;   /* of the string */
+    union {
+        int32_t n;
+        double f;
+        uint32_t str;   /* in STRS */
+    } u;
+} B_Const;
+
+#endif
@@ -0,0 +1,358 @@
+#include "lgc.h"
+#include "lvm.h"
+
+/*
+** Incremental mark and sweep. A cycle marks the roots (globals, stack,
+** constants), propagates gray objects a few at a time, finishes marking
+** atomically by rescanning the stack, then sweeps the string table and
+** allgc a few entries at a time. Objects created during the sweep get the
+** new white and survive it. Tables written to while black go back to gray
+** (gc_barriert), other black objects mark what they are given (gc_barrier).
+** Open upvalues are roots, their closures may all be gone before the
+** variable leaves the stack.
+*/
+
+#define GC_STEPSIZE 1024    /* bytes allocated between two steps */
+#define GC_SWEEPMAX 40      /* objects or string slots swept in one go */
+#define GC_SWEEPCOST 10     /* work units of sweeping one object */
+
+#define GC_OTHERWHITE(g) ((g)->white ^ GC_WHITES)
+#define GC_ISDEAD(g, o) ((o)->marked & GC_OTHERWHITE(g))
+
+static size_t _objsize(const GCObject *o) {
+    switch (o->gctype) {
+        case VT_STRING: {return lstring_objsize(CAST(const LString*, o));}
+        case VT_TABLE: {return ltable_memsize(CAST(const ltable*, o));}
+        case VT_CLOSURE: {
+            const V_Closure *c = CAST(const V_Closure*, o);
+            return sizeof(V_Closure) + c->nups * sizeof(V_UpVal*);
+        }
+        case VT_UPVAL: {return sizeof(V_UpVal);}
+        default: {error("not collectable: %d", o->gctype);} break;
+    }
+    return 0;
+}
+
+static void _freeobj(V_State *vs, GCObject *o) {
+    size_t size = _objsize(o);
+    vs->gc.totalbytes -= size;
+    vs->gc.freed += size;
+    switch (o->gctype) {
+        case VT_STRING: {free(o);} break;
+        case VT_TABLE: {ltable_free(CAST(ltable*, o));} break;
+        case VT_CLOSURE:
+        case VT_UPVAL: {free(o);} break;
+        default: {error("not collectable: %d", o->gctype);} break;
+    }
+}
+
+static void _account(V_State *vs, size_t size) {
+    vs->gc.totalbytes += size;
+    vs->gc.allocated += size;
+}
+
+void gc_init(V_State *vs) {
+    V_GC *g = &vs->gc;
+    g->state = GCS_PAUSE;
+    g->white = GC_WHITE0;
+    g->pause = GC_PAUSE;
+    g->stepmul = GC_STEPMUL;
+    g->threshold = 4 * GC_STEPSIZE;
+}
+
+void gc_freeall(V_State *vs) {
+    V_GC *g = &vs->gc;
+    while (g->allgc != NULL) {
+        GCObject *o = g->allgc;
+        g->allgc = o->gcnext;
+        _freeobj(vs, o);
+    }
+    FREE(g->gray.values);
+    FREE(g->grayagain.values);
+}
+
+void gc_resize(V_State *vs, long delta) {
+    if (delta >= 0) {
+        _account(vs, delta);
+    } else {
+        vs->gc.totalbytes -= -delta;
+        vs->gc.freed += -delta;
+    }
+}
+
+void gc_link(V_State *vs, GCObject *o) {
+    V_GC *g = &vs->gc;
+    o->marked = g->white;
+    o->gcnext = g->allgc;
+    g->allgc = o;
+    _account(vs, _objsize(o));
+}
+
+LString* gc_newstr(V_State *vs, const char *s, int len) {
+    int count = vs->strs->count;
+    LString *ls = lstring_new(vs->strs, s, len);
+    if (vs->strs->count != count) {
+        _account(vs, lstring_objsize(ls));
+    }
+    return ls;
+}
+
+LString* gc_borrowstr(V_State *vs, const char *s, int len) {
+    int count = vs->strs->count;
+    LString *ls = lstring_borrow(vs->strs, s, len);
+    if (vs->strs->count != count) {
+        _account(vs, lstring_objsize(ls));
+    }
+    return ls;
+}
+
+static void _pushgray(GCGrayStack *gs, GCObject *o) {
+    if (gs->count >= gs->size) {
+        gs->size = gs->size == 0 ? 64 : 2 * gs->size;
+        gs->values = realloc(gs->values, gs->size * sizeof(GCObject*));
+    }
+    gs->values[gs->count++] = o;
+}
+
+static void _markobject(V_GC *g, GCObject *o) {
+    if (!GC_ISWHITE(o)) {
+        return;
+    }
+    if (o->gctype == VT_STRING) {
+        o->marked = GC_BLACK;   /* nothing to traverse */
+        return;
+    }
+    o->marked = 0;
+    _pushgray(&g->gray, o);
+}
+
+static void _markvalue(V_GC *g, const Value *v) {
+    if (gc_iscollectable(v)) {
+        _markobject(g, CAST(GCObject*, VAL_OBJ(v)));
+    }
+}
+
+/* blacken a gray object, return the work done */
+static size_t _traverse(V_GC *g, GCObject *o) {
+    o->marked = GC_BLACK;
+    switch (o->gctype) {
+        case VT_TABLE: {
+            const ltable *lt = CAST(const ltable*, o);
+            for (int i = 0; i < lt->arraysize; ++i) {
+                _markvalue(g, &lt->array[i]);
+            }
+            /* keys of nil entries are left alone, they are only compared */
+            for (int i = 0; i < lt->hashsize; ++i) {
+                const tnode *n = &lt->hash[i];
+                if (VAL_TYPE(&n->val) != VT_NIL) {
+                    _markvalue(g, &n->key);
+                    _markvalue(g, &n->val);
+                }
+            }
+        } break;
+
+        case VT_CLOSURE: {
+            const V_Closure *c = CAST(const V_Closure*, o);
+            for (int i = 0; i < c->nups; ++i) {
+                _markobject(g, CAST(GCObject*, c->uv[i]));
+            }
+        } break;
+
+        case VT_UPVAL: {
+            const V_UpVal *uv = CAST(const V_UpVal*, o);
+            _markvalue(g, uv->v);
+        } break;
+
+        default: {error("can't traverse: %d", o->gctype);} break;
+    }
+    return _objsize(o);
+}
+
+static size_t _propagateall(V_GC *g) {
+    size_t work = 0;
+    while (g->gray.count > 0) {
+        work += _traverse(g, g->gray.values[--g->gray.count]);
+    }
+    return work;
+}
+
+static void _markstack(V_State *vs) {
+    V_GC *g = &vs->gc;
+    for (int i = 0; i < vs->stk.top; ++i) {
+        _markvalue(g, &vs->stk.values[i]);
+    }
+    for (V_UpVal *uv = vs->openuv; uv != NULL; uv = uv->next) {
+        _markobject(g, CAST(GCObject*, uv));
+    }
+}
+
+static void _markroots(V_State *vs) {
+    V_GC *g = &vs->gc;
+    g->gray.count = 0;
+    g->grayagain.count = 0;
+
+    _markobject(g, CAST(GCObject*, vs->globals));
+    _markstack(vs);
+    for (int i = 0; i < vs->funcs.count; ++i) {
+        const V_Func *fn = &vs->funcs.funcs[i];
+        for (int j = 0; j < fn->k.count; ++j) {
+            _markvalue(g, &fn->k.values[j]);
+        }
+    }
+}
+
+static void _atomic(V_State *vs) {
+    V_GC *g = &vs->gc;
+
+    /* the stack has no barrier */
+    _markstack(vs);
+    _propagateall(g);
+
+    while (g->grayagain.count > 0) {
+        _traverse(g, g->grayagain.values[--g->grayagain.count]);
+        _propagateall(g);
+    }
+
+    /* stale slots above top may become registers again without being written */
+    nil_values(vs->stk.values + vs->stk.top, vs->stk.size - vs->stk.top);
+
+    /* everything still white from now on is dead */
+    g->white = GC_OTHERWHITE(g);
+    vs->strs->white = g->white;
+
+    g->sweepstr = 0;
+    g->sweepgc = &g->allgc;
+    g->state = GCS_SWEEPSTRING;
+}
+
+static void _sweepstrings(V_State *vs) {
+    V_GC *g = &vs->gc;
+    lstrtab *st = vs->strs;
+    int end = g->sweepstr + GC_SWEEPMAX;
+    for (; g->sweepstr < end && g->sweepstr < st->size; ++g->sweepstr) {
+        GCObject **p = CAST(GCObject**, &st->slots[g->sweepstr]);
+        while (*p != NULL) {
+            GCObject *o = *p;
+            if (GC_ISDEAD(g, o)) {
+                *p = o->gcnext;
+                --st->count;
+                _freeobj(vs, o);
+            } else {
+                o->marked = g->white;
+                p = &o->gcnext;
+            }
+        }
+    }
+    if (g->sweepstr >= st->size) {
+        g->state = GCS_SWEEP;
+    }
+}
+
+static void _sweepobjects(V_State *vs) {
+    V_GC *g = &vs->gc;
+    GCObject **p = g->sweepgc;
+    for (int i = 0; i < GC_SWEEPMAX && *p != NULL; ++i) {
+        GCObject *o = *p;
+        if (GC_ISDEAD(g, o)) {
+            *p = o->gcnext;
+            _freeobj(vs, o);
+        } else {
+            o->marked = g->white;
+            p = &o->gcnext;
+        }
+    }
+    g->sweepgc = p;
+
+    if (*p == NULL) {
+        g->state = GCS_PAUSE;
+        g->estimate = g->totalbytes;
+        ++g->cycles;
+    }
+}
+
+static size_t _singlestep(V_State *vs) {
+    V_GC *g = &vs->gc;
+    switch (g->state) {
+        case GCS_PAUSE: {
+            _markroots(vs);
+            g->state = GCS_PROPAGATE;
+            return GC_SWEEPMAX * GC_SWEEPCOST;
+        }
+
+        case GCS_PROPAGATE: {
+            if (g->gray.count > 0) {
+                return _traverse(g, g->gray.values[--g->gray.count]);
+            }
+            _atomic(vs);
+            return GC_SWEEPMAX * GC_SWEEPCOST;
+        }
+
+        case GCS_SWEEPSTRING: {
+            _sweepstrings(vs);
+            return GC_SWEEPMAX * GC_SWEEPCOST;
+        }
+
+        case GCS_SWEEP: {
+            _sweepobjects(vs);
+            return GC_SWEEPMAX * GC_SWEEPCOST;
+        }
+    }
+    return 0;
+}
+
+static void _setthreshold(V_GC *g) {
+    if (g->state == GCS_PAUSE) {
+        g->threshold = g->estimate / 100 * g->pause;
+        if (g->threshold < g->totalbytes + GC_STEPSIZE) {
+            g->threshold = g->totalbytes + GC_STEPSIZE;
+        }
+    } else {
+        g->threshold = g->totalbytes + GC_STEPSIZE;
+    }
+}
+
+void gc_step(V_State *vs) {
+    V_GC *g = &vs->gc;
+    long work = GC_STEPSIZE / 100 * g->stepmul;
+    ++g->steps;
+    do {
+        work -= _singlestep(vs);
+    } while (work > 0 && g->state != GCS_PAUSE);
+    _setthreshold(g);
+}
+
+void gc_fullcollect(V_State *vs) {
+    V_GC *g = &vs->gc;
+
+    /* finish the cycle in progress, its marks may be stale */
+    while (g->state != GCS_PAUSE) {
+        _singlestep(vs);
+    }
+
+    do {
+        _singlestep(vs);
+    } while (g->state != GCS_PAUSE);
+    _setthreshold(g);
+}
+
+void gc_barrierback(V_State *vs, GCObject *t) {
+    t->marked = 0;
+    _pushgray(&vs->gc.grayagain, t);
+}
+
+void gc_barrierf(V_State *vs, GCObject *o, GCObject *v) {
+    V_GC *g = &vs->gc;
+    if (g->state == GCS_PROPAGATE) {
+        _markobject(g, v);
+    } else {
+        o->marked = g->white;   /* sweeping, don't bother again until next cycle */
+    }
+}
+
+/* roots are marked once, when a cycle starts */
+void gc_barrierroot(V_State *vs, const Value *v) {
+    V_GC *g = &vs->gc;
+    if (g->state == GCS_PROPAGATE) {
+        _markvalue(g, v);
+    }
+}
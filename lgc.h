@@ -0,0 +1,92 @@
+#ifndef lgc_h
+#define lgc_h
+
+#include "luna.h"
+#include "lstring.h"
+
+#define GC_PAUSE 200    /* start a new cycle when memory in use doubles */
+#define GC_STEPMUL 200  /* collect twice as fast as we allocate */
+
+typedef enum {
+    GCS_PAUSE,
+    GCS_PROPAGATE,
+    GCS_SWEEPSTRING,
+    GCS_SWEEP,
+} GCState;
+
+typedef struct {
+    int size;
+    int count;
+    GCObject **values;
+} GCGrayStack;
+
+typedef struct {
+    GCState state;
+    unsigned char white;    /* color of objects created now */
+    GCObject *allgc;        /* tables and closures, strings live in vs->strs */
+    GCObject **sweepgc;     /* next link of allgc to sweep */
+    int sweepstr;           /* next slot of vs->strs to sweep */
+    GCGrayStack gray;
+    GCGrayStack grayagain;  /* black tables written to, traversed again in atomic */
+
+    size_t totalbytes;  /* bytes held by collectable objects */
+    size_t threshold;   /* do a step when totalbytes reaches it */
+    size_t estimate;    /* bytes in use after the last cycle */
+
+    int pause;      /* percent of estimate to wait for before a new cycle */
+    int stepmul;    /* percent of allocated bytes to collect per step */
+
+    /* statistics */
+    unsigned long cycles;
+    unsigned long steps;
+    size_t allocated;   /* bytes ever allocated */
+    size_t freed;       /* bytes ever freed */
+} V_GC;
+
+struct V_State;
+
+void gc_init(struct V_State *vs);
+void gc_freeall(struct V_State *vs);
+
+void gc_link(struct V_State *vs, GCObject *o);
+void gc_resize(struct V_State *vs, long delta);  /* a linked object grew by `delta' bytes */
+LString* gc_newstr(struct V_State *vs, const char *s, int len);
+LString* gc_borrowstr(struct V_State *vs, const char *s, int len);
+
+void gc_step(struct V_State *vs);
+void gc_fullcollect(struct V_State *vs);
+
+void gc_barrierback(struct V_State *vs, GCObject *t);
+void gc_barrierf(struct V_State *vs, GCObject *o, GCObject *v);
+void gc_barrierroot(struct V_State *vs, const Value *v);    /* a root already marked now holds `v' */
+
+static inline int gc_iscollectable(const Value *v) {
+    ValueType t = VAL_TYPE(v);
+    return t == VT_STRING || t == VT_TABLE || t == VT_CLOSURE;
+}
+
+#define GC_ISWHITE(o) ((o)->marked & GC_WHITES)
+#define GC_ISBLACK(o) ((o)->marked & GC_BLACK)
+#define GC_VALISWHITE(v) (gc_iscollectable(v) && GC_ISWHITE(CAST(GCObject*, VAL_OBJ(v))))
+
+#define gc_check(vs) do {\
+    if ((vs)->gc.totalbytes >= (vs)->gc.threshold) {\
+        gc_step(vs);\
+    }\
+} while (0)
+
+/* table `t' is about to hold `v' */
+#define gc_barriert(vs, t, v) do {\
+    if (GC_ISBLACK(CAST(GCObject*, t)) && GC_VALISWHITE(v)) {\
+        gc_barrierback(vs, CAST(GCObject*, t));\
+    }\
+} while (0)
+
+/* object `o' other than a table is about to hold `v' */
+#define gc_barrier(vs, o, v) do {\
+    if (GC_ISBLACK(CAST(GCObject*, o)) && GC_VALISWHITE(v)) {\
+        gc_barrierf(vs, CAST(GCObject*, o), CAST(GCObject*, VAL_OBJ(v)));\
+    }\
+} while (0)
+
+#endif
@@ -0,0 +1,365 @@
+#include <limits.h>
+#include <math.h>
+#include "luna.h"
+#include "lopt.h"
+
+/*
+** Each function is rewritten right in its instrs array. Instructions are
+** never moved, only marked dead and dropped at the end, when jump offsets
+** are fixed to land on the same instruction, or the first one alive after
+** it.
+*/
+typedef struct {
+    A_State *as;    /* arena of fn, for more constants */
+    A_Func *fn;
+    int n;
+    A_Instr *code;
+    unsigned char *dead;
+    unsigned char *target;  /* control may arrive other than from i - 1 */
+    unsigned char *pinned;  /* may name an upvalue of the CLOSURE before, see _load */
+    int kcap;       /* room in fn->consts */
+} O_Func;
+
+/* skips the next instruction on some condition */
+static int _isskip(const A_Instr *ins) {
+    switch (ins->t) {
+        case OP_EQ: case OP_LT: case OP_LE: case OP_TEST: case OP_TESTSET:
+        case OP_TFORLOOP: {
+            return 1;
+        }
+        case OP_LOADBOOL: {
+            return ins->u.bc.c != 0;
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+static int _isjump(const A_Instr *ins) {
+    return ins->t == OP_JMP || ins->t == OP_FORLOOP || ins->t == OP_FORPREP;
+}
+
+static void _marktargets(O_Func *of) {
+    memset(of->target, 0, of->n + 2);
+    for (int i = 0; i < of->n; ++i) {
+        const A_Instr *ins = &of->code[i];
+        if (_isjump(ins)) {
+            of->target[i + 1 + ins->u.bx] = 1;
+            /* a FORPREP whose loop doesn't run goes on after the FORLOOP */
+            if (ins->t == OP_FORPREP) {
+                of->target[i + 2 + ins->u.bx] = 1;
+            }
+        } else if (_isskip(ins)) {
+            of->target[i + 2] = 1;
+        }
+    }
+}
+
+static void _load(O_Func *of, A_State *as, A_Func *fn) {
+    of->as = as;
+    of->fn = fn;
+    of->n = fn->instrs.count;
+    of->code = fn->instrs.instrs;
+    of->dead = NEW_ARRAY(unsigned char, of->n);
+    of->target = NEW_ARRAY(unsigned char, of->n + 2);
+    of->kcap = fn->consts.count;
+
+    /*
+    ** everything below relies on jumps staying in the function, landing
+    ** at the very end runs the RETURN the loader adds
+    */
+    for (int i = 0; i < of->n; ++i) {
+        const A_Instr *ins = &of->code[i];
+        int t = i + 1 + ins->u.bx;
+        if ((_isjump(ins) && (t < 0 || t > of->n))
+                || (ins->t == OP_FORPREP && t + 1 > of->n)
+                || (_isskip(ins) && i + 2 > of->n)) {
+            error("%s: jump out of function at %d", fn->name, i);
+        }
+    }
+
+    /*
+    ** A CLOSURE is followed by a MOVE or GETUPVAL per upvalue, never run.
+    ** How many depends on the function made, which may not be parsed yet,
+    ** so all of those right after it stay as they are.
+    */
+    of->pinned = NEW_ARRAY(unsigned char, of->n);
+    for (int i = 0; i < of->n; ++i) {
+        if (of->code[i].t != OP_CLOSURE) {
+            continue;
+        }
+        for (int j = i + 1; j < of->n && (of->code[j].t == OP_MOVE || of->code[j].t == OP_GETUPVAL); ++j) {
+            of->pinned[j] = 1;
+        }
+    }
+}
+
+/* drop the dead instructions, moving the rest down */
+static void _store(O_Func *of) {
+    int *newidx = NEW_ARRAY(int, of->n + 1);
+    int count = 0;
+    for (int i = 0; i < of->n; ++i) {
+        newidx[i] = count;
+        count += !of->dead[i];
+    }
+    newidx[of->n] = count;
+
+    for (int i = 0; i < of->n; ++i) {
+        if (of->dead[i]) {
+            continue;
+        }
+        A_Instr *ins = &of->code[newidx[i]];
+        *ins = of->code[i];
+        if (_isjump(ins)) {
+            ins->u.bx = newidx[i + 1 + ins->u.bx] - (newidx[i] + 1);
+        }
+    }
+    of->fn->instrs.count = count;
+
+    FREE(newidx);
+    FREE(of->dead);
+    FREE(of->target);
+    FREE(of->pinned);
+}
+
+/* a JMP to a JMP goes straight to where the last one goes */
+static void _threadjumps(O_Func *of) {
+    for (int i = 0; i < of->n; ++i) {
+        A_Instr *ins = &of->code[i];
+        if (ins->t != OP_JMP) {
+            continue;
+        }
+        int t = i + 1 + ins->u.bx;
+        for (int hops = 0; t < of->n && of->code[t].t == OP_JMP && hops < of->n; ++hops) {
+            t = t + 1 + of->code[t].u.bx;
+        }
+        ins->u.bx = t - (i + 1);
+    }
+}
+
+static void _dropunreachable(O_Func *of) {
+    unsigned char *seen = NEW_ARRAY(unsigned char, of->n + 1);
+    int *work = NEW_ARRAY(int, of->n + 1);
+    int top = 0;
+#define O_REACH(x) do {\
+    int pc_ = (x);\
+    if (pc_ < of->n && !seen[pc_]) {\
+        seen[pc_] = 1;\
+        work[top++] = pc_;\
+    }\
+} while (0)
+
+    if (of->n > 0) {
+        O_REACH(0);
+    }
+    while (top > 0) {
+        int i = work[--top];
+        const A_Instr *ins = &of->code[i];
+        int t = i + 1 + ins->u.bx;
+        switch (ins->t) {
+            case OP_RETURN: {} break;
+            case OP_JMP: {O_REACH(t);} break;
+            case OP_FORPREP: {O_REACH(i + 1); O_REACH(t); O_REACH(t + 1);} break;
+            case OP_FORLOOP: {O_REACH(i + 1); O_REACH(t);} break;
+            case OP_LOADBOOL: {O_REACH(ins->u.bc.c ? i + 2 : i + 1);} break;
+            default: {
+                if (_isskip(ins)) {
+                    O_REACH(i + 2);
+                }
+                O_REACH(i + 1);
+            } break;
+        }
+    }
+#undef O_REACH
+
+    for (int i = 0; i < of->n; ++i) {
+        of->dead[i] |= !seen[i];
+    }
+    FREE(work);
+    FREE(seen);
+}
+
+/*
+** MOVE a a and a JMP over nothing but dead code, unless a skip counts on
+** them being there. Backwards, so a JMP sees the fate of those it skips.
+*/
+static void _dropnops(O_Func *of) {
+    for (int i = of->n - 1; i >= 0; --i) {
+        const A_Instr *ins = &of->code[i];
+        int nop = ins->t == OP_MOVE && ins->a == ins->u.bc.b;
+        if (ins->t == OP_JMP) {
+            int t = i + 1 + ins->u.bx;
+            nop = t > i;
+            for (int j = i + 1; nop && j < t; ++j) {
+                nop = of->dead[j];
+            }
+        }
+        if (nop && !of->pinned[i] && !(i > 0 && _isskip(&of->code[i - 1]))) {
+            of->dead[i] = 1;
+        }
+    }
+}
+
+/* MOVE a b; MOVE b a: the second one changes nothing */
+static void _dropmoveback(O_Func *of) {
+    _marktargets(of);
+    for (int i = 0; i + 1 < of->n; ++i) {
+        const A_Instr *ins = &of->code[i];
+        const A_Instr *next = &of->code[i + 1];
+        if (!of->dead[i] && ins->t == OP_MOVE && next->t == OP_MOVE
+                && next->a == ins->u.bc.b && next->u.bc.b == ins->a && !of->target[i + 1]
+                && !of->pinned[i] && !of->pinned[i + 1]) {
+            of->dead[i + 1] = 1;
+        }
+    }
+}
+
+static const Value* _getconst(const A_Func *fn, int idx) {
+    if (idx >= fn->consts.count) {
+        error("%s: const %d overflow: %d", fn->name, idx, fn->consts.count);
+    }
+    return &fn->consts.values[idx];
+}
+
+/* index of a constant equal to `v', added if there's none */
+static int _addconst(O_Func *of, const Value *v) {
+    A_ValueStream *ks = &of->fn->consts;
+    for (int i = 0; i < ks->count; ++i) {
+        const Value *k = &ks->values[i];
+        if (VAL_TYPE(k) != VAL_TYPE(v)) {
+            continue;
+        }
+        if (VAL_TYPE(v) == VT_INT && VAL_INT(k) == VAL_INT(v)) {
+            return i;
+        }
+        if (VAL_TYPE(v) == VT_FLOAT) {
+            double a = VAL_FLOAT(k);
+            double b = VAL_FLOAT(v);
+            if (memcmp(&a, &b, sizeof(double)) == 0) {
+                return i;
+            }
+        }
+    }
+    if (ks->count == of->kcap) {
+        of->kcap = 2 * of->kcap + 4;
+        Value *values = A_alloc(of->as, of->kcap * sizeof(Value));
+        if (ks->count > 0) {
+            memcpy(values, ks->values, ks->count * sizeof(Value));
+        }
+        ks->values = values;
+    }
+    copy_value(&ks->values[ks->count], v);
+    return ks->count++;
+}
+
+/*
+** `b op c' the way the VM would do it: int op int stays int unless it
+** overflows, the rest is done in double. 0 if it can't be done here.
+*/
+static int _arith(A_OpCode op, const Value *b, const Value *c, Value *r) {
+    int isnum = (VAL_TYPE(b) == VT_INT || VAL_TYPE(b) == VT_FLOAT)
+        && (VAL_TYPE(c) == VT_INT || VAL_TYPE(c) == VT_FLOAT);
+    if (!isnum) {
+        return 0;
+    }
+    if (VAL_TYPE(b) == VT_INT && VAL_TYPE(c) == VT_INT && op != OP_DIV && op != OP_POW) {
+        long long x = VAL_INT(b);
+        long long y = VAL_INT(c);
+        long long n;
+        switch (op) {
+            case OP_ADD: {n = x + y;} break;
+            case OP_SUB: {n = x - y;} break;
+            case OP_MUL: {n = x * y;} break;
+            case OP_MOD: {
+                if (y == 0) {
+                    return 0;   /* an error at run time */
+                }
+                n = x % y;
+                if (n != 0 && (n ^ y) < 0) {
+                    n += y;
+                }
+            } break;
+            default: {return 0;}
+        }
+        if (n >= INT_MIN && n <= INT_MAX) {
+            SET_INT(r, CAST(int, n));
+        } else {
+            SET_FLOAT(r, CAST(double, n));
+        }
+        return 1;
+    }
+
+    double x = VAL_TYPE(b) == VT_INT ? VAL_INT(b) : VAL_FLOAT(b);
+    double y = VAL_TYPE(c) == VT_INT ? VAL_INT(c) : VAL_FLOAT(c);
+    double f;
+    switch (op) {
+        case OP_ADD: {f = x + y;} break;
+        case OP_SUB: {f = x - y;} break;
+        case OP_MUL: {f = x * y;} break;
+        case OP_DIV: {
+            if (y == 0) {
+                return 0;
+            }
+            f = x / y;
+        } break;
+        case OP_MOD: {
+            if (y == 0) {
+                return 0;
+            }
+            f = fmod(x, y);
+            if (f != 0 && (f < 0) != (y < 0)) {
+                f += y;
+            }
+        } break;
+        case OP_POW: {f = pow(x, y);} break;
+        default: {return 0;}
+    }
+    if (f != f) {
+        return 0;
+    }
+    SET_FLOAT(r, f);
+    return 1;
+}
+
+/* arithmetic on two constants becomes a LOADK of the result */
+static void _foldconsts(O_Func *of) {
+    for (int i = 0; i < of->n; ++i) {
+        A_Instr *ins = &of->code[i];
+        if (ins->t < OP_ADD || ins->t > OP_POW || ins->u.bc.b >= 0 || ins->u.bc.c >= 0) {
+            continue;
+        }
+        Value r;
+        const Value *b = _getconst(of->fn, -ins->u.bc.b - 1);
+        const Value *c = _getconst(of->fn, -ins->u.bc.c - 1);
+        if (!_arith(ins->t, b, c, &r)) {
+            continue;
+        }
+        ins->t = OP_LOADK;
+        ins->u.bx = -_addconst(of, &r) - 1;
+    }
+}
+
+void O_optimizefunc(A_State *as, A_Func *fn, int level) {
+    if (level <= 0) {
+        return;
+    }
+    O_Func of;
+    _load(&of, as, fn);
+    if (level >= 2) {
+        _foldconsts(&of);
+    }
+    _threadjumps(&of);
+    _dropunreachable(&of);
+    _dropnops(&of);
+    if (level >= 2) {
+        _dropmoveback(&of);
+    }
+    _store(&of);
+}
+
+void O_optimize(A_State *as, int level) {
+    for (int i = 0; i < as->funcs.count; ++i) {
+        O_optimizefunc(as, as->funcs.funcs[i], level);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef lopt_h
+#define lopt_h
+
+#include "lasm.h"
+
+/*
+** Optimizer of the assembler, run on each function between A_parsefunc
+** and A_binfunc, or over all of them between A_parse and A_createbin_v1:
+**     -O0  nothing, the .lbin has exactly the instructions of the .lasm
+**     -O1  thread JMP chains, drop unreachable code and no-op MOVE/JMP
+**     -O2  also fold arithmetic on constants and drop MOVEs undoing
+**          the one before
+*/
+#define O_MAXLEVEL 2
+
+void O_optimizefunc(A_State *as, A_Func *fn, int level);   /* fn of as */
+void O_optimize(A_State *as, int level);
+
+#endif
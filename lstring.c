@@ -0,0 +1,92 @@
+#include "lstring.h"
+
+lstrtab* lstrtab_new(int size) {
+    lstrtab *st = NEW(lstrtab);
+    st->size = size;
+    st->slots = NEW_ARRAY(LString*, size);
+    st->white = GC_WHITE0;
+    return st;
+}
+
+void lstrtab_free(lstrtab *st) {
+    for (int i = 0; i < st->size; ++i) {
+        LString *ls = st->slots[i];
+        while (ls != NULL) {
+            LString *next = CAST(LString*, ls->gcnext);
+            free(ls);
+            ls = next;
+        }
+    }
+    FREE(st->slots);
+    FREE(st);
+}
+
+static unsigned int _hash(const char *s, int len) {
+    unsigned int h = CAST(unsigned int, len);
+    for (int i = 0; i < len; ++i) {
+        h = h ^ ((h << 5) + (h >> 2) + CAST(unsigned char, s[i]));
+    }
+    return h;
+}
+
+static void _resize(lstrtab *st, int size) {
+    LString **slots = NEW_ARRAY(LString*, size);
+    for (int i = 0; i < st->size; ++i) {
+        LString *ls = st->slots[i];
+        while (ls != NULL) {
+            LString *next = CAST(LString*, ls->gcnext);
+            int sidx = ls->hash % size;
+            ls->gcnext = CAST(GCObject*, slots[sidx]);
+            slots[sidx] = ls;
+            ls = next;
+        }
+    }
+    FREE(st->slots);
+    st->slots = slots;
+    st->size = size;
+}
+
+static LString* _intern(lstrtab *st, const char *s, int len, int borrow) {
+    unsigned int h = _hash(s, len);
+    for (LString *ls = st->slots[h % st->size]; ls != NULL; ls = CAST(LString*, ls->gcnext)) {
+        if (ls->hash == h && ls->len == len && memcmp(ls->s, s, len) == 0) {
+            if (ls->marked & (st->white ^ GC_WHITES)) {
+                ls->marked = st->white;    /* dead but not swept yet, revive it */
+            }
+            return ls;
+        }
+    }
+
+    if (st->count >= st->size) {
+        _resize(st, st->size * 2);
+    }
+
+    LString *ls = NULL;
+    if (borrow) {
+        ls = NEW(LString);
+        ls->s = s;
+    } else {
+        ls = NEW_SIZE(LString, lstring_size(len));
+        memcpy(ls->data, s, len);
+        ls->data[len] = '\0';
+        ls->s = ls->data;
+    }
+    ls->gctype = VT_STRING;
+    ls->marked = st->white;
+    ls->hash = h;
+    ls->len = len;
+
+    int sidx = h % st->size;
+    ls->gcnext = CAST(GCObject*, st->slots[sidx]);
+    st->slots[sidx] = ls;
+    ++st->count;
+    return ls;
+}
+
+LString* lstring_new(lstrtab *st, const char *s, int len) {
+    return _intern(st, s, len, 0);
+}
+
+LString* lstring_borrow(lstrtab *st, const char *s, int len) {
+    return _intern(st, s, len, 1);
+}
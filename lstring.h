@@ -0,0 +1,30 @@
+#ifndef lstring_h
+#define lstring_h
+
+#include "luna.h"
+
+/* immutable string, interned: equal strings are the same object */
+typedef struct LString {
+    GC_HEADER;  /* gcnext chains the string table slot */
+    unsigned int hash;
+    int len;
+    const char *s;  /* len bytes, `data' or borrowed (not '\0' terminated) */
+    char data[];    /* len bytes and a trailing '\0', if not borrowed */
+} LString;
+
+typedef struct {
+    int size;
+    int count;
+    LString **slots;
+    unsigned char white;    /* color of new strings, kept by the collector */
+} lstrtab;
+
+lstrtab* lstrtab_new(int size);
+void lstrtab_free(lstrtab *st);
+LString* lstring_new(lstrtab *st, const char *s, int len);
+LString* lstring_borrow(lstrtab *st, const char *s, int len);  /* `s' must outlive `st' */
+
+#define lstring_size(len) (sizeof(LString) + (len) + 1)
+#define lstring_objsize(ls) ((ls)->s == (ls)->data ? lstring_size((ls)->len) : sizeof(LString))
+
+#endif
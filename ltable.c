@@ -1,34 +1,401 @@
 #include "ltable.h"
 
-ltable* ltable_new(int arraysize) {
+#define MAXBITS 26  /* integer keys above 2^MAXBITS never go to the array part */
+#define MAXASIZE (1 << MAXBITS)
+
+/* the hash part is kept at most 3/4 full */
+#define HASHFULL(used, size) (4 * (used) > 3 * (size))
+
+/*
+** 0 is never a shape, inline caches start out empty. 64 bits never wrap
+** around, so a shape is never given to two layouts and a cache filled
+** from one table can't match another.
+*/
+static uint64_t _lastshape = 0;
+
+static unsigned int _mix(unsigned int h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned int _hashvalue(const Value *key) {
+    switch (VAL_TYPE(key)) {
+        case VT_INT: {return _mix(CAST(unsigned int, VAL_INT(key)));}
+        case VT_BOOL: {return VAL_BOOL(key);}
+        case VT_STRING: {return VAL_STR(key)->hash;}
+        case VT_FLOAT: {
+            double d = VAL_FLOAT(key);
+            unsigned int h[2];
+            memcpy(h, &d, sizeof(d));
+            return _mix(h[0] ^ h[1]);
+        }
+        default: {return _mix(CAST(unsigned int, CAST(uintptr_t, VAL_OBJ(key)) >> 3));}
+    }
+}
+
+static int _rawequal(const Value *a, const Value *b) {
+    if (VAL_TYPE(a) != VAL_TYPE(b)) {
+        return 0;
+    }
+    switch (VAL_TYPE(a)) {
+        case VT_NIL: {return 1;}
+        case VT_INT: {return VAL_INT(a) == VAL_INT(b);}
+        case VT_BOOL: {return VAL_BOOL(a) == VAL_BOOL(b);}
+        case VT_FLOAT: {return VAL_FLOAT(a) == VAL_FLOAT(b);}
+        default: {return VAL_OBJ(a) == VAL_OBJ(b);}
+    }
+}
+
+/* floats with an integral value are the same key as the integer */
+static int _floatkey(double d, int *n) {
+    if (d >= -2147483648.0 && d < 2147483648.0 && d == CAST(double, CAST(int, d))) {
+        *n = CAST(int, d);
+        return 1;
+    }
+    return 0;
+}
+
+/* slot holding `key', or the free slot where it would go */
+static tnode* _findslot(tnode *hash, int size, const Value *key) {
+    unsigned int mask = size - 1;
+    unsigned int i = _hashvalue(key) & mask;
+    for (;;) {
+        tnode *n = &hash[i];
+        if (VAL_TYPE(&n->key) == VT_NIL || _rawequal(&n->key, key)) {
+            return n;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+ltable* ltable_new(int narray, int nhash) {
     ltable *t = NEW(ltable);
-    t->arraysize = arraysize;
-    t->array = NEW_ARRAY(Value, arraysize);
-    t->hash = htable_new(1024); /* TODO: hard coded */
-    t->arraysize = arraysize;
+    t->gctype = VT_TABLE;
+    t->arraysize = narray;
+    t->array = NULL;
+    if (narray > 0) {
+        t->array = NEW_ARRAY(Value, narray);
+        nil_values(t->array, narray);
+    }
+    t->hashsize = 0;
+    t->hashused = 0;
+    t->hash = NULL;
+    t->shape = ++_lastshape;
+    if (nhash > 0) {
+        int size = 4;
+        while (HASHFULL(nhash, size)) {
+            size *= 2;
+        }
+        t->hashsize = size;
+        t->hash = NEW_ARRAY(tnode, size);
+        for (int i = 0; i < size; ++i) {
+            SET_NIL(&t->hash[i].key);
+            SET_NIL(&t->hash[i].val);
+        }
+    }
     return t;
 }
 
 void ltable_free(ltable *lt) {
+    FREE(lt->array);
+    FREE(lt->hash);
+    FREE(lt);
 }
 
-void ltable_setarray(ltable *lt, int idx, const Value *v) {
-    if (idx >= lt->arraysize) {
-        error("array index overflow: index %d size %d", idx, lt->arraysize);
+const Value* ltable_getint(const ltable *lt, int key) {
+    if (CAST(unsigned int, key) - 1 < CAST(unsigned int, lt->arraysize)) {
+        const Value *v = &lt->array[key - 1];
+        return VAL_TYPE(v) == VT_NIL ? NULL : v;
+    }
+    if (lt->hashsize == 0) {
+        return NULL;
     }
-    copy_value(&lt->array[idx], v);
+    Value k;
+    SET_INT(&k, key);
+    const tnode *n = _findslot(lt->hash, lt->hashsize, &k);
+    return VAL_TYPE(&n->val) == VT_NIL ? NULL : &n->val;
 }
 
-void ltable_settable(ltable *lt, const char *key, const Value *v) {
-    Value *vcopy = NEW(Value);
-    copy_value(vcopy, v);
-    htable_add(lt->hash, key, vcopy);
+int ltable_slotstr(const ltable *lt, const LString *key) {
+    if (lt->hashsize == 0) {
+        return -1;
+    }
+    unsigned int mask = lt->hashsize - 1;
+    unsigned int i = key->hash & mask;
+    for (;;) {
+        const tnode *n = &lt->hash[i];
+        if (VAL_TYPE(&n->key) == VT_STRING && VAL_STR(&n->key) == key) {
+            return i;
+        }
+        if (VAL_TYPE(&n->key) == VT_NIL) {
+            return -1;
+        }
+        i = (i + 1) & mask;
+    }
 }
 
-Value* ltable_gettable(ltable *lt, const char *key) {
-    return CAST(Value*, htable_find(lt->hash, key));
+const Value* ltable_getstr(const ltable *lt, const LString *key) {
+    int slot = ltable_slotstr(lt, key);
+    if (slot < 0 || VAL_TYPE(&lt->hash[slot].val) == VT_NIL) {
+        return NULL;
+    }
+    return &lt->hash[slot].val;
 }
 
+const Value* ltable_get(const ltable *lt, const Value *key) {
+    switch (VAL_TYPE(key)) {
+        case VT_NIL: {return NULL;}
+        case VT_INT: {return ltable_getint(lt, VAL_INT(key));}
+        case VT_STRING: {return ltable_getstr(lt, VAL_STR(key));}
+        case VT_FLOAT: {
+            int n;
+            if (_floatkey(VAL_FLOAT(key), &n)) {
+                return ltable_getint(lt, n);
+            }
+        } break;
+        default: break;
+    }
+    if (lt->hashsize == 0) {
+        return NULL;
+    }
+    const tnode *n = _findslot(lt->hash, lt->hashsize, key);
+    return VAL_TYPE(&n->val) == VT_NIL ? NULL : &n->val;
+}
+
+/* count integer key `key' in its slice (2^(lg-1), 2^lg] */
+static int _countint(const Value *key, int *nums) {
+    if (VAL_TYPE(key) == VT_INT) {
+        int k = VAL_INT(key);
+        if (k > 0 && k <= MAXASIZE) {
+            int lg = 0;
+            while ((1 << lg) < k) {
+                ++lg;
+            }
+            ++nums[lg];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* largest n such that more than half of 1..n is in use */
+static int _computesizes(const int *nums, int *narray) {
+    int a = 0, na = 0, n = 0;
+    for (int i = 0, twotoi = 1; twotoi / 2 < *narray; ++i, twotoi *= 2) {
+        if (nums[i] > 0) {
+            a += nums[i];
+            if (a > twotoi / 2) {
+                n = twotoi;
+                na = a;
+            }
+        }
+        if (a == *narray) {
+            break;
+        }
+    }
+    *narray = n;
+    return na;
+}
+
+static void _resize(ltable *lt, int narray, int nhash) {
+    int oldasize = lt->arraysize;
+    Value *oldarray = lt->array;
+    int oldhsize = lt->hashsize;
+    tnode *oldhash = lt->hash;
+
+    lt->arraysize = narray;
+    lt->array = NULL;
+    if (narray > 0) {
+        lt->array = NEW_ARRAY(Value, narray);
+        int keep = oldasize < narray ? oldasize : narray;
+        if (keep > 0) {
+            memcpy(lt->array, oldarray, keep * sizeof(Value));
+        }
+        nil_values(lt->array + keep, narray - keep);
+    }
+
+    lt->hashsize = 0;
+    lt->hashused = 0;
+    lt->hash = NULL;
+    lt->shape = ++_lastshape;
+    if (nhash > 0) {
+        int size = 4;
+        while (HASHFULL(nhash, size)) {
+            size *= 2;
+        }
+        lt->hashsize = size;
+        lt->hash = NEW_ARRAY(tnode, size);
+        for (int i = 0; i < size; ++i) {
+            SET_NIL(&lt->hash[i].key);
+            SET_NIL(&lt->hash[i].val);
+        }
+    }
+
+    /* the sizes were computed for what is live, these can't trigger a resize */
+    for (int i = narray; i < oldasize; ++i) {
+        if (VAL_TYPE(&oldarray[i]) != VT_NIL) {
+            ltable_setint(lt, i + 1, &oldarray[i]);
+        }
+    }
+    for (int i = 0; i < oldhsize; ++i) {
+        const tnode *n = &oldhash[i];
+        if (VAL_TYPE(&n->val) != VT_NIL) {
+            ltable_set(lt, &n->key, &n->val);
+        }
+    }
+    FREE(oldarray);
+    FREE(oldhash);
+}
+
+/* make room for the new key `key' */
+static long _rehash(ltable *lt, const Value *key) {
+    size_t before = ltable_memsize(lt);
+    int nums[MAXBITS + 1];
+    memset(nums, 0, sizeof(nums));
+
+    int nint = 0;
+    for (int lg = 0, i = 1; lg <= MAXBITS && i <= lt->arraysize; ++lg) {
+        int lim = 1 << lg;
+        if (lim > lt->arraysize) {
+            lim = lt->arraysize;
+        }
+        for (; i <= lim; ++i) {
+            if (VAL_TYPE(&lt->array[i - 1]) != VT_NIL) {
+                ++nums[lg];
+                ++nint;
+            }
+        }
+    }
+
+    int total = nint;
+    for (int i = 0; i < lt->hashsize; ++i) {
+        const tnode *n = &lt->hash[i];
+        if (VAL_TYPE(&n->val) != VT_NIL) {
+            nint += _countint(&n->key, nums);
+            ++total;
+        }
+    }
+    nint += _countint(key, nums);
+    ++total;
+
+    int na = _computesizes(nums, &nint);
+    _resize(lt, nint, total - na);
+    return CAST(long, ltable_memsize(lt)) - CAST(long, before);
+}
+
+long ltable_set(ltable *lt, const Value *key, const Value *v) {
+    switch (VAL_TYPE(key)) {
+        case VT_NIL: {error("table index is nil");} break;
+        case VT_INT: {return ltable_setint(lt, VAL_INT(key), v);}
+        case VT_FLOAT: {
+            int n;
+            if (_floatkey(VAL_FLOAT(key), &n)) {
+                return ltable_setint(lt, n, v);
+            }
+            if (VAL_FLOAT(key) != VAL_FLOAT(key)) {
+                error("table index is NaN");
+            }
+        } break;
+        default: break;
+    }
+
+    if (lt->hashsize > 0) {
+        tnode *n = _findslot(lt->hash, lt->hashsize, key);
+        if (VAL_TYPE(&n->key) != VT_NIL) {
+            copy_value(&n->val, v);
+            return 0;
+        }
+        if (!HASHFULL(lt->hashused + 1, lt->hashsize)) {
+            copy_value(&n->key, key);
+            copy_value(&n->val, v);
+            ++lt->hashused;
+            return 0;
+        }
+    }
+    if (VAL_TYPE(v) == VT_NIL) {
+        return 0;   /* absent already */
+    }
+    long grown = _rehash(lt, key);
+    return grown + ltable_set(lt, key, v);
+}
+
+long ltable_setint(ltable *lt, int key, const Value *v) {
+    if (CAST(unsigned int, key) - 1 < CAST(unsigned int, lt->arraysize)) {
+        copy_value(&lt->array[key - 1], v);
+        return 0;
+    }
+
+    Value k;
+    SET_INT(&k, key);
+    if (lt->hashsize > 0) {
+        tnode *n = _findslot(lt->hash, lt->hashsize, &k);
+        if (VAL_TYPE(&n->key) != VT_NIL) {
+            copy_value(&n->val, v);
+            return 0;
+        }
+        if (!HASHFULL(lt->hashused + 1, lt->hashsize)) {
+            n->key = k;
+            copy_value(&n->val, v);
+            ++lt->hashused;
+            return 0;
+        }
+    }
+    if (VAL_TYPE(v) == VT_NIL) {
+        return 0;
+    }
+    long grown = _rehash(lt, &k);
+    return grown + ltable_setint(lt, key, v);
+}
+
+/* a border: t[n] ~= nil and t[n + 1] == nil */
 int ltable_len(const ltable *lt) {
-    return lt->arraysize;
+    int j = lt->arraysize;
+    if (j > 0 && VAL_TYPE(&lt->array[j - 1]) == VT_NIL) {
+        int i = 0;
+        while (j - i > 1) {
+            int m = (i + j) / 2;
+            if (VAL_TYPE(&lt->array[m - 1]) == VT_NIL) {
+                j = m;
+            } else {
+                i = m;
+            }
+        }
+        return i;
+    }
+    if (lt->hashsize == 0) {
+        return j;
+    }
+
+    int i = j;
+    ++j;
+    while (ltable_getint(lt, j) != NULL) {
+        i = j;
+        if (j > MAXASIZE) {
+            /* pathological table, fall back to a linear search */
+            i = 1;
+            while (ltable_getint(lt, i) != NULL) {
+                ++i;
+            }
+            return i - 1;
+        }
+        j *= 2;
+    }
+    while (j - i > 1) {
+        int m = (i + j) / 2;
+        if (ltable_getint(lt, m) == NULL) {
+            j = m;
+        } else {
+            i = m;
+        }
+    }
+    return i;
+}
+
+size_t ltable_memsize(const ltable *lt) {
+    return sizeof(ltable) + lt->arraysize * sizeof(Value) +
+        lt->hashsize * sizeof(tnode);
 }
@@ -2,19 +2,43 @@
 #define ltable_h
 
 #include "luna.h"
-#include "htable.h"
+#include "lstring.h"
+
+/*
+** Lua style table: integer keys 1..arraysize live in `array', everything
+** else in an open addressed (linear probing) hash part keyed by any Value.
+** A key set to nil keeps its slot until the next rehash.
+*/
+typedef struct {
+    Value key;  /* nil: free slot */
+    Value val;
+} tnode;
 
 typedef struct ltable {
+    GC_HEADER;
     int arraysize;
-    Value *array;
-    htable *hash;
+    Value *array;   /* array[i - 1] holds key i */
+    int hashsize;   /* 0 or a power of 2 */
+    int hashused;   /* slots with a key */
+    tnode *hash;
+    uint64_t shape;    /* unique id of this hash layout, changes on rehash */
 } ltable;
 
-ltable* ltable_new(int arraysize);
+ltable* ltable_new(int narray, int nhash);
 void ltable_free(ltable *lt);
-void ltable_setarray(ltable *lt, int idx, const Value *v);
-void ltable_settable(ltable *lt, const char *key, const Value *v);
-Value* ltable_gettable(ltable *lt, const char *key);
+
+const Value* ltable_get(const ltable *lt, const Value *key);
+const Value* ltable_getint(const ltable *lt, int key);
+const Value* ltable_getstr(const ltable *lt, const LString *key);
+
+/* index in `hash' of the slot holding `key', -1 if there's none */
+int ltable_slotstr(const ltable *lt, const LString *key);
+
+/* these return how many bytes the table grew (or shrank) by */
+long ltable_set(ltable *lt, const Value *key, const Value *v);
+long ltable_setint(ltable *lt, int key, const Value *v);
+
 int ltable_len(const ltable *lt);
+size_t ltable_memsize(const ltable *lt);
 
 #endif
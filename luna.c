@@ -37,51 +37,15 @@ void snapshot(const char* code, int pos, int line) {
         if (i == pos - 1) {
             printf("^");
         } else {
-            printf("%c", isblank(code[i]) ? code[i] : ' ');
+            printf("%c", isblank(CAST(unsigned char, code[i])) ? code[i] : ' ');
         }
     }
     printf("\n'''\n");
 }
 
-char* load_file(const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        perror("Open file failed");
-        exit(-1);
-    }
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    rewind(f);
-
-    char *fdata = NEW_SIZE(char, fsize + 1);
-    fread(fdata, sizeof(char), fsize, f);
-    fclose(f); f = NULL;
-    return fdata;
-}
-
-void copy_value(Value *dest, const Value *src) {
-    if (dest->t == VT_STRING) {
-        FREE(dest->u.s);
-    }
-    if (src == NULL) {
-        dest->t = VT_NIL;
-        return;
-    }
-    dest->t = src->t;
-    switch (src->t) {
-        case VT_INT: {dest->u.n = src->u.n;} break;
-        case VT_FLOAT: {dest->u.f = src->u.f;} break;
-        case VT_STRING: {dest->u.s = strdup(src->u.s);} break;
-
-        case VT_TABLE:
-        case VT_CALLINFO:
-        case VT_CLOSURE: {dest->u.o = src->u.o;} break;
-
-        case VT_NIL: {/* nothing to copy */} break;
-
-        default: {
-            error("not imp: %d", src->t);
-        } break;
+/* zeroed memory is not nil in every Value layout */
+void nil_values(Value *values, int n) {
+    for (int i = 0; i < n; ++i) {
+        SET_NIL(&values[i]);
     }
 }
-
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <ctype.h>
@@ -29,7 +30,6 @@
 
 void errorf(const char *where, const char *fmt, ...);
 void snapshot(const char* code, int pos, int line);
-char* load_file(const char *filename);
 
 typedef enum {
     VT_NIL,
@@ -39,20 +39,112 @@ typedef enum {
     VT_BOOL,
     VT_TABLE,
     VT_CLOSURE,
-    VT_VALUEP,  /* pointer to Value */
-    VT_CALLINFO,
+    VT_UPVAL,   /* only the type of a collectable object, never of a Value */
 } ValueType;
 
+/* every collectable object (string, table, closure) starts with this */
+#define GC_HEADER struct GCObject *gcnext; unsigned char gctype; unsigned char marked
+
+typedef struct GCObject {
+    GC_HEADER;
+} GCObject;
+
+/* object colors, gray is neither white nor black */
+#define GC_WHITE0 1
+#define GC_WHITE1 2
+#define GC_BLACK 4
+#define GC_WHITES (GC_WHITE0 | GC_WHITE1)
+
+struct LString;
+
+/*
+** The Value layout is chosen at compile time. By default a Value is a type
+** tag plus a union, 16 bytes. Built with -DLUNA_NANBOX a Value is 8 bytes:
+** doubles are stored as they are, every other type is boxed in the payload
+** of a negative quiet NaN, with `type + 1' in bits 47..50 and the int or
+** pointer in the low bits. Only go through the VAL_ and SET_ macros.
+*/
+#ifdef LUNA_NANBOX
+
+typedef struct {
+    uint64_t n;
+} Value;
+
+#define NB_QNAN 0xFFF8000000000000ULL
+#define NB_TAGSHIFT 47
+#define NB_TAGMASK (0xFULL << NB_TAGSHIFT)
+#define NB_PAYLOAD ((1ULL << NB_TAGSHIFT) - 1)
+#define NB_CANONNAN 0x7FF8000000000000ULL
+
+#define NB_ISBOXED(b) (((b) & NB_QNAN) == NB_QNAN && ((b) & NB_TAGMASK) != 0)
+#define NB_BOX(t, p) (NB_QNAN | (CAST(uint64_t, (t) + 1) << NB_TAGSHIFT) | (p))
+
+static inline double nb_tofloat(uint64_t n) {
+    double f;
+    memcpy(&f, &n, sizeof(f));
+    return f;
+}
+
+static inline uint64_t nb_fromfloat(double f) {
+    uint64_t n;
+    if (f != f) {   /* keep NaNs out of the boxed space */
+        return NB_CANONNAN;
+    }
+    memcpy(&n, &f, sizeof(n));
+    return n;
+}
+
+#define VAL_TYPE(v) (NB_ISBOXED((v)->n) ? CAST(ValueType, (((v)->n & NB_TAGMASK) >> NB_TAGSHIFT) - 1) : VT_FLOAT)
+#define VAL_INT(v) CAST(int, CAST(uint32_t, (v)->n))
+#define VAL_BOOL(v) VAL_INT(v)
+#define VAL_FLOAT(v) nb_tofloat((v)->n)
+#define VAL_OBJ(v) CAST(void*, CAST(uintptr_t, (v)->n & NB_PAYLOAD))
+#define VAL_STR(v) CAST(struct LString*, VAL_OBJ(v))
+
+#define SET_NIL(v) ((v)->n = NB_BOX(VT_NIL, 0))
+#define SET_INT(v, x) ((v)->n = NB_BOX(VT_INT, CAST(uint32_t, (x))))
+#define SET_BOOL(v, x) ((v)->n = NB_BOX(VT_BOOL, CAST(uint32_t, (x))))
+#define SET_FLOAT(v, x) ((v)->n = nb_fromfloat(x))
+#define SET_OBJ(v, tt, x) ((v)->n = NB_BOX(tt, CAST(uintptr_t, (x)) & NB_PAYLOAD))
+#define SET_STR(v, x) SET_OBJ(v, VT_STRING, x)
+
+#else
+
 typedef struct {
     ValueType t;
     union {
         int n;
         double f;
-        char *s;
+        struct LString *s;
         void *o;
     } u;
 } Value;
 
-void copy_value(Value *dest, const Value *src);
+#define VAL_TYPE(v) ((v)->t)
+#define VAL_INT(v) ((v)->u.n)
+#define VAL_BOOL(v) ((v)->u.n)
+#define VAL_FLOAT(v) ((v)->u.f)
+#define VAL_OBJ(v) ((v)->u.o)
+#define VAL_STR(v) ((v)->u.s)
+
+#define SET_NIL(v) ((v)->t = VT_NIL)
+#define SET_INT(v, x) ((v)->t = VT_INT, (v)->u.n = (x))
+#define SET_BOOL(v, x) ((v)->t = VT_BOOL, (v)->u.n = (x))
+#define SET_FLOAT(v, x) ((v)->t = VT_FLOAT, (v)->u.f = (x))
+#define SET_OBJ(v, tt, x) ((v)->t = (tt), (v)->u.o = (x))
+#define SET_STR(v, x) ((v)->t = VT_STRING, (v)->u.s = (x))
+
+#endif
+
+/* strings are interned and immutable, so copying any Value is a plain copy */
+static inline void copy_value(Value *dest, const Value *src) {
+    if (src == NULL) {
+        SET_NIL(dest);
+    } else {
+        *dest = *src;
+    }
+}
+
+void nil_values(Value *values, int n);
 
 #endif
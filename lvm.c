@@ -1,8 +1,16 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "luna.h"
 #include "lvm.h"
 #include "ltable.h"
 
 #define V_MIN_CI 8
+#define V_MAX_CI 200000
+#define V_MAX_STACK 1000000
 
 #define V_PACK_FID_A_C(fid, a, c) (CAST(unsigned char, fid) + (CAST(unsigned char, a) << 8) + (CAST(unsigned short, c) << 16))
 #define V_UNPACK_FID(n) (CAST(unsigned int, n) << 24 >> 24)
@@ -10,46 +18,110 @@
 #define V_UNPACK_C(n) (CAST(unsigned int, n) >> 16)
 
 #define V_CHECKTYPE(v, vt) do {\
-    if (v->t != vt) {\
-        error("expect type %d, got %d\n", vt, v->t);\
+    if (VAL_TYPE(v) != vt) {\
+        error("expect type %d, got %d\n", vt, VAL_TYPE(v));\
     }\
 } while (0)
 
-static void _printins(const V_State *vs, const A_Instr *ins);
+#define Kst(x) (-x - 1)
+
+/*
+** Opcodes only the loader writes, never found in a .lbin: FORPREP/FORLOOP
+** pairs whose loop is known to be int or float (see _specialize), and
+** superinstructions (see _fuse).
+*/
+enum {
+    V_OP_FORPREPI = A_NUM_OPCODES,
+    V_OP_FORLOOPI,
+    V_OP_FORPREPF,
+    V_OP_FORLOOPF,
+    V_OP_EQJMP,
+    V_OP_LTJMP,
+    V_OP_LEJMP,
+    V_OP_LOADKADD,
+    V_OP_GETGLOBALCALL,
+    V_OP_GETTABLE2,
+    V_NUM_OPCODES,
+};
+
+/* name and the opcode each stands for, in the order above */
+static const struct {
+    const char *name;
+    int op;
+} V_ops[] = {
+    {"FORPREPI", OP_FORPREP}, {"FORLOOPI", OP_FORLOOP},
+    {"FORPREPF", OP_FORPREP}, {"FORLOOPF", OP_FORLOOP},
+    {"EQJMP", OP_EQ}, {"LTJMP", OP_LT}, {"LEJMP", OP_LE},
+    {"LOADKADD", OP_LOADK}, {"GETGLOBALCALL", OP_GETGLOBAL}, {"GETTABLE2", OP_GETTABLE},
+};
+
+static void _printins(const V_State *vs, uint32_t ins);
 static V_Func* _get_curfunc(const V_State *vs);
 static V_Func* _get_func(const V_State *vs, int idx);
-static Value* _get_reg(const V_State *vs, int idx);
 static void _push(V_State *vs, const Value *v);
 static void _pop(V_State *vs, int n);
-static V_CallInfo* _pushci(V_State *vs, int func, int ip, int retb, int rete);
+static V_CallInfo* _pushci(V_State *vs, const Value *cl, int func, int ip, int retb, int rete);
 static void _popci(V_State *vs);
 
 V_State* V_newstate(int stacksize) {
     V_State *vs = NEW(V_State);
-    /* TODO: any better size? */
-    vs->globals = ltable_new(0);
-    vs->funcs = list_new();
+    gc_init(vs);
+    vs->globals = ltable_new(0, 0);
+    gc_link(vs, CAST(GCObject*, vs->globals));
+    vs->strs = lstrtab_new(64);
 
+    if (stacksize < V_MIN_STACK) {
+        stacksize = V_MIN_STACK;
+    }
     vs->stk.size = stacksize;
     vs->stk.values = NEW_ARRAY(Value, stacksize);
+    nil_values(vs->stk.values, stacksize);
 
     vs->cis.size = V_MIN_CI;
     vs->cis.count = 0;
-    vs->cis.values = NEW_ARRAY(V_CallInfo*, V_MIN_CI);
+    vs->cis.max = V_MAX_CI;
+    vs->cis.values = NEW_ARRAY(V_CallInfo, V_MIN_CI);
+
+    vs->lazy = 1;
+    vs->fuse = 1;
 
     return vs;
 }
 
+/* code of a function may still be where the .lbin is mapped */
+static int _inbin(const V_State *vs, const void *p) {
+    const char *bin = vs->bin;
+    return bin != NULL && CAST(const char*, p) >= bin && CAST(const char*, p) < bin + vs->binsize;
+}
+
 void V_freestate(V_State *vs) {
-    ltable_free(vs->globals);
+    for (int i = 0; i < vs->funcs.count; ++i) {
+        V_Func *fn = &vs->funcs.funcs[i];
+        FREE(fn->k.values);
+        FREE(fn->subf.values);
+        FREE(fn->ic);
+        if (!_inbin(vs, fn->ins.code)) {
+            FREE(fn->ins.code);
+        }
+    }
+    FREE(vs->funcs.funcs);
+    gc_freeall(vs);
+    lstrtab_free(vs->strs);
+    FREE(vs->stk.values);
+    FREE(vs->cis.values);
+    if (vs->bin != NULL) {
+        munmap(vs->bin, vs->binsize);
+    }
+    FREE(vs->binfile);
+    FREE(vs->k.values);
     FREE(vs);
 }
 
 void _show_status(const V_State *vs) {
     printf("version: %d.%d\n", vs->major, vs->minor);
 
-    for (lnode *n = vs->funcs->head; n != NULL; n = n->next) {
-        const V_Func *fn = CAST(const V_Func*, n->data);
+    for (int i = 0; i < vs->funcs.count; ++i) {
+        const V_Func *fn = &vs->funcs.funcs[i];
 
         printf("%s (%d instructions, %d regs, %d consts)\n", fn->name, fn->ins.count, fn->regcount, fn->k.count);
 
@@ -57,163 +129,746 @@ void _show_status(const V_State *vs) {
         for (int i = 0; i < fn->k.count; ++i) {
             printf("%d.\t", i);
             const Value *k = &fn->k.values[i];
-            switch (k->t) {
-                case VT_INT: {printf("%d\n", k->u.n);} break;
-                case VT_FLOAT: {printf("%lf\n", k->u.f);} break;
-                case VT_STRING: {printf("%s\n", k->u.s);} break;
-                default: {error("unexpected const value type: %d", k->t);} break;
+            switch (VAL_TYPE(k)) {
+                case VT_INT: {printf("%d\n", VAL_INT(k));} break;
+                case VT_FLOAT: {printf("%lf\n", VAL_FLOAT(k));} break;
+                case VT_STRING: {printf("%.*s\n", VAL_STR(k)->len, VAL_STR(k)->s);} break;
+                default: {error("unexpected const value type: %d", VAL_TYPE(k));} break;
             }
         }
         printf("INSTRUCTIONS:\n");
         for (int i = 0; i < fn->ins.count; ++i) {
-            const A_Instr *ins = &fn->ins.instrs[i];
             printf("%d.\t", i);
-            _printins(vs, ins);
+            _printins(vs, fn->ins.code[i]);
         }
         printf("\n");
     }
 }
 
-void V_load(V_State *vs, const char *binfile) {
-    FILE *f = fopen(binfile, "rb");
-    if (f == NULL) {
-        error("Load %s failed: %s", binfile, strerror(errno));
+/* bounds checked cursor over the mapped .lbin */
+typedef struct {
+    const char *file;
+    const unsigned char *base;
+    const unsigned char *p;
+    const unsigned char *end;
+} V_Reader;
+
+static const void* _rbytes(V_Reader *r, size_t n) {
+    if (CAST(size_t, r->end - r->p) < n) {
+        error("%s: truncated at offset %ld", r->file, CAST(long, r->p - r->base));
     }
+    const void *p = r->p;
+    r->p += n;
+    return p;
+}
 
-    /* HEADER */
-    char ident[4];
-    FREAD(ident, 1, 4, f);
-    if (strncmp(ident, "LUNA", 4) != 0) {
-        error("File format not support: `%s'", ident);
+#define V_READ(r, dst, n) memcpy(dst, _rbytes(r, n), n)
+
+/* a count of items taking at least `minsize' bytes each, checked before allocating */
+static int _rcount(V_Reader *r, const char *what, size_t minsize) {
+    int n = 0;
+    V_READ(r, &n, 4);
+    if (n < 0 || CAST(size_t, n) * minsize > CAST(size_t, r->end - r->p)) {
+        error("%s: bad %s count %d at offset %ld", r->file, what, n, CAST(long, r->p - r->base) - 4);
     }
-    FREAD(&vs->major, 2, 1, f);
-    FREAD(&vs->minor, 2, 1, f);
+    return n;
+}
 
-    /* FUNCTIONS */
-    int fcount = 0;
-    FREAD(&fcount, 4, 1, f);
-    for (int i = 0; i < fcount; ++i) {
-        V_Func *fn = NEW(V_Func);
-
-        /* NAME */
-        int n = 0;
-        FREAD(&n, 1, 1, f);
-        FREAD(fn->name, 1, n, f);
-
-        /* PARAM */
-        FREAD(&fn->param, 2, 1, f);
-
-        /* REGCOUNT */
-        FREAD(&fn->regcount, 2, 1, f);
- 
-        /* CONSTS */
-        FREAD(&fn->k.count, 4, 1, f);
-        if (fn->k.count > 0) {
-            fn->k.values = NEW_ARRAY(Value, fn->k.count);
-            for (int i = 0; i < fn->k.count; ++i) {
-                Value *k = &fn->k.values[i];
-                FREAD(&k->t, 1, 1, f);
-                switch (k->t) {
-                    case VT_INT: {FREAD(&k->u.n, 4, 1, f);} break;
-                    case VT_FLOAT: {FREAD(&k->u.f, 4, 1, f);} break;
-                    case VT_STRING: {
-                        int len = 0;
-                        FREAD(&len, 4, 1, f);
-                        k->u.s = NEW_SIZE(char, len + 1);
-                        FREAD(k->u.s, 1, len, f);
-                    } break;
-                    default: {error("unexpected const value type: %d", k->t);} break;
-                }
+static void _checkk(const V_Reader *r, const V_Func *fn, int pc, int k) {
+    if (k >= 0) {
+        return;
+    }
+    if (Kst(k) >= fn->k.count) {
+        error("%s: %s: constant %d overflow at %d: %d consts", r->file, fn->name, Kst(k), pc, fn->k.count);
+    }
+}
+
+static void _checkreg(const V_Reader *r, const V_Func *fn, int pc, int reg) {
+    if (reg < 0 || reg >= fn->regcount) {
+        error("%s: %s: register %d overflow at %d: %d regs", r->file, fn->name, reg, pc, fn->regcount);
+    }
+}
+
+/* registers an instruction touches beyond its plain operands */
+static void _checkrange(const V_Reader *r, const V_Func *fn, int pc, const A_Instr *ins) {
+    int a = ins->a, b = ins->u.bc.b, c = ins->u.bc.c;
+    switch (ins->t) {
+        case OP_SELF: {_checkreg(r, fn, pc, a + 1);} break;
+        case OP_FORLOOP:
+        case OP_FORPREP: {_checkreg(r, fn, pc, a + 3);} break;
+        case OP_TFORLOOP: {_checkreg(r, fn, pc, a + 2 + c);} break;
+        case OP_SETLIST: {_checkreg(r, fn, pc, a + b);} break;
+        case OP_CALL:
+        case OP_TAILCALL: {
+            if (b > 0) {
+                _checkreg(r, fn, pc, a + b - 1);
+            }
+            if (c > 1) {
+                _checkreg(r, fn, pc, a + c - 2);
             }
+        } break;
+        case OP_RETURN:
+        case OP_VARARG: {
+            if (b > 1) {
+                _checkreg(r, fn, pc, a + b - 2);
+            }
+        } break;
+        default: break;
+    }
+}
+
+/*
+** checks a decoded instruction, `maxjump' keeps the furthest jump target
+** and fn->nups counts the upvalues used so far
+*/
+/* NEWTABLE size hints are "floating point bytes": eeeeexxx */
+#define V_MAXFB ((21 << 3) | 7)     /* largest hint taken, 15 << 20 slots */
+
+static int _fb2int(int x) {
+    int e = (x >> 3) & 31;
+    if (e == 0) {
+        return x;
+    }
+    return ((x & 7) + 8) << (e - 1);
+}
+
+static void _checkins(const V_Reader *r, V_Func *fn, int i, const A_Instr *ins, int *maxjump) {
+    const A_OpMode *om = &A_OpModes[ins->t];
+    if (om->a != OpArgN) {
+        _checkreg(r, fn, i, ins->a);
+    }
+    if (om->m == iABC) {
+        if (om->b == OpArgK) {
+            _checkk(r, fn, i, ins->u.bc.b);
+        }
+        if (om->c == OpArgK) {
+            _checkk(r, fn, i, ins->u.bc.c);
         }
+        if (om->b == OpArgR || (om->b == OpArgK && ins->u.bc.b >= 0)) {
+            _checkreg(r, fn, i, ins->u.bc.b);
+        }
+        if (om->c == OpArgR || (om->c == OpArgK && ins->u.bc.c >= 0)) {
+            _checkreg(r, fn, i, ins->u.bc.c);
+        }
+    }
+
+    _checkrange(r, fn, i, ins);
+
+    switch (ins->t) {
+        /* the global opcodes don't check their key when running */
+        case OP_LOADK:
+        case OP_GETGLOBAL:
+        case OP_SETGLOBAL: {
+            int idx = Kst(ins->u.bx);
+            if (idx < 0 || idx >= fn->k.count) {
+                error("%s: %s: constant %d overflow at %d: %d consts", r->file, fn->name, idx, i, fn->k.count);
+            }
+            if (ins->t != OP_LOADK && VAL_TYPE(&fn->k.values[idx]) != VT_STRING) {
+                error("%s: string constant expected by %s at %d, got %d",
+                    fn->name, A_opnames[ins->t], i, ins->u.bx);
+            }
+        } break;
+
+        case OP_JMP:
+        case OP_FORLOOP:
+        case OP_FORPREP: {
+            int target = i + 1 + ins->u.bx;
+            if (target < 0 || target > fn->ins.count) {
+                error("%s: %s: jump out of function at %d: %d", r->file, fn->name, i, target);
+            }
+            /* a loop that doesn't run goes on after its FORLOOP */
+            if (ins->t == OP_FORPREP) {
+                ++target;
+            }
+            if (target > *maxjump) {
+                *maxjump = target;
+            }
+        } break;
+
+        /* these may skip the next instruction */
+        case OP_LOADBOOL:
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE:
+        case OP_TEST:
+        case OP_TESTSET: {
+            if ((ins->t != OP_LOADBOOL || ins->u.bc.c != 0) && i + 2 > *maxjump) {
+                *maxjump = i + 2;
+            }
+        } break;
+
+        /* the hints are sized as they are, without any limit when running */
+        case OP_NEWTABLE: {
+            int b = ins->u.bc.b, c = ins->u.bc.c;
+            if (b < 0 || b > V_MAXFB || c < 0 || c > V_MAXFB) {
+                error("%s: %s: table size hint %d %d too big at %d", r->file, fn->name, b, c, i);
+            }
+        } break;
+
+        case OP_CLOSURE: {
+            if (ins->u.bx < 0 || ins->u.bx >= fn->subf.count) {
+                error("subfunc idx overflow: %d of %d", ins->u.bx, fn->subf.count);
+            }
+        } break;
+
+        /* also the ones after a CLOSURE passing an upvalue on */
+        case OP_GETUPVAL:
+        case OP_SETUPVAL: {
+            if (ins->u.bc.b < 0) {
+                error("%s: %s: bad upvalue %d at %d", r->file, fn->name, ins->u.bc.b, i);
+            }
+            if (ins->u.bc.b >= fn->nups) {
+                fn->nups = ins->u.bc.b + 1;
+            }
+        } break;
 
-        /* SUBFUNCS */
-        FREAD(&fn->subf.count, 4, 1, f);
-        if (fn->subf.count > 0) {
-            fn->subf.values = NEW_ARRAY(Value, fn->subf.count);
-            for (int i = 0; i < fn->subf.count; ++i) {
-                Value *v = &fn->subf.values[i];
-                v->t = VT_INT;
-                FREAD(&v->u.n, 4, 1, f);
+        default: break;
+    }
+}
+
+/* type of the number register `reg' is known to hold at `pc', VT_NIL if it isn't */
+static ValueType _regtype(const V_Func *fn, const unsigned char *target, int pc, int reg) {
+    for (int i = pc - 1; i >= 0 && !target[i + 1]; --i) {
+        uint32_t w = fn->ins.code[i];
+        int op = A_GET_OP(w);
+        if (op == OP_LOADK && A_GETARG_A(w) == reg) {
+            return VAL_TYPE(&fn->k.values[A_GETARG_Bx(w)]);
+        }
+        /* these may write other registers than R(A), or leave the block */
+        switch (op) {
+            case OP_LOADNIL: case OP_SELF: case OP_JMP: case OP_CALL: case OP_TAILCALL:
+            case OP_RETURN: case OP_FORLOOP: case OP_FORPREP: case OP_TFORLOOP:
+            case OP_VARARG: {
+                return VT_NIL;
             }
+            default: break;
+        }
+        if (A_OpModes[op].a != OpArgN && A_GETARG_A(w) == reg) {
+            return VT_NIL;
         }
+    }
+    return VT_NIL;
+}
 
-        /* INSTRUCTIONS */
-        FREAD(&fn->ins.count, 4, 1, f);
-        if (fn->ins.count > 0) {
-            fn->ins.instrs = NEW_ARRAY(A_Instr, fn->ins.count);
-            for (int i = 0; i < fn->ins.count; ++i) {
-                A_Instr *ins = &fn->ins.instrs[i];
-                FREAD(&ins->t, 1, 1, f);
-                const A_OpMode *om = &A_OpModes[ins->t];
-                if (om->a != OpArgN) {
-                    FREAD(&ins->a, 1, 1, f);
-                }
-                switch (om->m) {
-                    case iABC: {
-                        if (om->b != OpArgN) {
-                            FREAD(&ins->u.bc.b, 2, 1, f);
-                        }
-                        if (om->c != OpArgN) {
-                            FREAD(&ins->u.bc.c, 2, 1, f);
-                        }
-                    } break;
+/*
+** Every FORPREP must jump to a FORLOOP jumping back right after it. When
+** init and step of the loop come from constants just before the FORPREP,
+** the pair is rewritten into the int or float only version.
+*/
+static void _specialize(const V_Reader *r, V_Func *fn) {
+    int n = fn->ins.count;
+    uint32_t *code = fn->ins.code;
+    unsigned char *target = NULL;
+    for (int i = 0; i < n; ++i) {
+        uint32_t w = code[i];
+        if (A_GET_OP(w) != OP_FORPREP) {
+            continue;
+        }
+        int loop = i + 1 + A_GETARG_sBx(w);
+        if (A_GET_OP(code[loop]) != OP_FORLOOP || A_GETARG_A(code[loop]) != A_GETARG_A(w)
+                || loop + 1 + A_GETARG_sBx(code[loop]) != i + 1) {
+            error("%s: %s: FORPREP at %d without its FORLOOP", r->file, fn->name, i);
+        }
 
-                    case iABx:
-                    case iAsBx: {
-                        if (om->b != OpArgN) {
-                            FREAD(&ins->u.bx, 4, 1, f);
-                        }
-                    } break;
+        /* where control may arrive other than from the instruction before */
+        if (target == NULL) {
+            target = NEW_ARRAY(unsigned char, n + 1);
+            for (int j = 0; j < n; ++j) {
+                A_Instr ins;
+                A_decode(code[j], &ins);
+                switch (ins.t) {
+                    case OP_JMP: case OP_FORLOOP: {target[j + 1 + ins.u.bx] = 1;} break;
+                    case OP_FORPREP: {target[j + 1 + ins.u.bx + 1] = 1;} break;
+                    case OP_LOADBOOL: case OP_EQ: case OP_LT: case OP_LE: case OP_TEST:
+                    case OP_TESTSET: {target[j + 2] = 1;} break;
+                    default: break;
                 }
             }
         }
 
-        if (strcmp(fn->name, "main") == 0) {
-            list_pushfront(vs->funcs, fn);
-        } else {
-            list_pushback(vs->funcs, fn);
+        int a = A_GETARG_A(w);
+        ValueType tinit = _regtype(fn, target, i, a);
+        ValueType tstep = _regtype(fn, target, i, a + 2);
+        if (tinit == VT_INT && tstep == VT_INT) {
+            A_SET_OP(code[i], V_OP_FORPREPI);
+            A_SET_OP(code[loop], V_OP_FORLOOPI);
+        } else if ((tinit == VT_INT || tinit == VT_FLOAT) && (tstep == VT_INT || tstep == VT_FLOAT)) {
+            A_SET_OP(code[i], V_OP_FORPREPF);
+            A_SET_OP(code[loop], V_OP_FORLOOPF);
         }
     }
+    FREE(target);
+}
 
-    long read = ftell(f);
-    fseek(f, 0, SEEK_END);
-    long total = ftell(f);
-    if (read != total) {
-        fclose(f); f = NULL;
-        error("load file failed: %ld of %ld", read, total);
+/*
+** Superinstructions: the first of a common pair is rewritten in place into
+** one that does the work of both. The second is left as it is, so a jump to
+** it still works and every instruction keeps its number for errors and
+** tracing.
+*/
+static void _fuse(V_Func *fn) {
+    uint32_t *code = fn->ins.code;
+    for (int i = 0; i + 1 < fn->ins.count; ++i) {
+        int next = A_GET_OP(code[i + 1]);
+        int op = -1;
+        switch (A_GET_OP(code[i])) {
+            case OP_EQ: {op = next == OP_JMP ? V_OP_EQJMP : -1;} break;
+            case OP_LT: {op = next == OP_JMP ? V_OP_LTJMP : -1;} break;
+            case OP_LE: {op = next == OP_JMP ? V_OP_LEJMP : -1;} break;
+            case OP_LOADK: {op = next == OP_ADD ? V_OP_LOADKADD : -1;} break;
+            case OP_GETGLOBAL: {op = next == OP_CALL ? V_OP_GETGLOBALCALL : -1;} break;
+            case OP_GETTABLE: {op = next == OP_GETTABLE ? V_OP_GETTABLE2 : -1;} break;
+            default: break;
+        }
+        if (op >= 0) {
+            A_SET_OP(code[i], op);
+        }
     }
-    fclose(f); f = NULL;
+}
 
-    _show_status(vs);
+/* `owned' is fn->ins.code if it was allocated for fn, NULL if it's in the mapping */
+static void _endfunc(V_State *vs, const V_Reader *r, V_Func *fn, uint32_t *owned, int maxjump) {
+    /* the interpreter only leaves a function through RETURN */
+    int n = fn->ins.count;
+    if (n == 0 || A_GET_OP(fn->ins.code[n - 1]) != OP_RETURN) {
+        uint32_t *code = NEW_ARRAY(uint32_t, n + 1);
+        if (n > 0) {
+            memcpy(code, fn->ins.code, n * sizeof(uint32_t));
+        }
+        code[n] = A_CREATE_ABC(OP_RETURN, 0, 1, 0);
+        FREE(owned);
+        fn->ins.code = code;
+        fn->ins.count = n + 1;
+    }
+    if (maxjump >= fn->ins.count) {
+        error("%s: %s: jump past the end: %d", r->file, fn->name, maxjump);
+    }
+    _specialize(r, fn);
+    /* traced runs see every instruction dispatched on its own */
+    if (vs->fuse && vs->trace == V_TRACE_OFF) {
+        _fuse(fn);
+    }
+    fn->ic = NEW_ARRAY(V_ICache, fn->ins.count);
+}
+
+static void _loadfunc(V_State *vs, V_Reader *r, V_Func *fn, int fcount) {
+    /* NAME */
+    int n = 0;
+    V_READ(r, &n, 1);
+    if (n >= MAX_NAME_LEN) {
+        error("%s: function name too long: %d", r->file, n);
+    }
+    V_READ(r, fn->name, n);
+
+    /* PARAM */
+    V_READ(r, &fn->param, 2);
+
+    /* REGCOUNT */
+    V_READ(r, &fn->regcount, 2);
+    if (fn->param > fn->regcount) {
+        error("%s: %s: %d params but %d regs", r->file, fn->name, fn->param, fn->regcount);
+    }
+
+    /* CONSTS */
+    fn->k.count = _rcount(r, "const", 5);
+    if (fn->k.count > 0) {
+        fn->k.values = NEW_ARRAY(Value, fn->k.count);
+        for (int i = 0; i < fn->k.count; ++i) {
+            Value *k = &fn->k.values[i];
+            unsigned char t = 0;
+            V_READ(r, &t, 1);
+            switch (t) {
+                case VT_INT: {
+                    int num = 0;
+                    V_READ(r, &num, 4);
+                    SET_INT(k, num);
+                } break;
+                case VT_FLOAT: {
+                    double d = 0.0;
+                    V_READ(r, &d, 4);
+                    SET_FLOAT(k, d);
+                } break;
+                case VT_STRING: {
+                    int len = 0;
+                    V_READ(r, &len, 4);
+                    if (len < 0) {
+                        error("%s: %s: bad string length %d", r->file, fn->name, len);
+                    }
+                    SET_STR(k, gc_borrowstr(vs, _rbytes(r, len), len));
+                } break;
+                default: {error("unexpected const value type: %d", t);} break;
+            }
+        }
+    }
+
+    /* SUBFUNCS */
+    fn->subf.count = _rcount(r, "subfunc", 4);
+    if (fn->subf.count > 0) {
+        fn->subf.values = NEW_ARRAY(Value, fn->subf.count);
+        for (int i = 0; i < fn->subf.count; ++i) {
+            int fnidx = 0;
+            V_READ(r, &fnidx, 4);
+            if (fnidx < 0 || fnidx >= fcount) {
+                error("%s: subfunc %d overflow: %d of %d", fn->name, i, fnidx, fcount);
+            }
+            SET_INT(&fn->subf.values[i], fnidx);
+        }
+    }
+
+    /* INSTRUCTIONS, variable length: decoded, checked and encoded as they come */
+    fn->ins.count = _rcount(r, "instruction", 1);
+    int maxjump = 0;
+    uint32_t *code = NULL;
+    if (fn->ins.count > 0) {
+        code = NEW_ARRAY(uint32_t, fn->ins.count);
+        for (int i = 0; i < fn->ins.count; ++i) {
+            A_Instr instr;
+            A_Instr *ins = &instr;
+            memset(ins, 0, sizeof(*ins));
+            V_READ(r, &ins->t, 1);
+            if (ins->t >= A_NUM_OPCODES) {
+                error("%s: %s: bad opcode %d at %d", r->file, fn->name, ins->t, i);
+            }
+            const A_OpMode *om = &A_OpModes[ins->t];
+            if (om->a != OpArgN) {
+                V_READ(r, &ins->a, 1);
+            }
+            switch (om->m) {
+                case iABC: {
+                    if (om->b != OpArgN) {
+                        V_READ(r, &ins->u.bc.b, 2);
+                    }
+                    if (om->c != OpArgN) {
+                        V_READ(r, &ins->u.bc.c, 2);
+                    }
+                } break;
+
+                case iABx:
+                case iAsBx: {
+                    if (om->b != OpArgN) {
+                        V_READ(r, &ins->u.bx, 4);
+                    }
+                } break;
+            }
+            _checkins(r, fn, i, ins, &maxjump);
+            if (!A_encode(ins, &code[i])) {
+                error("%s: %s: operands of %s at %d don't fit in 32 bits", r->file, fn->name, A_opnames[ins->t], i);
+            }
+        }
+    }
+    fn->ins.code = code;
+    _endfunc(vs, r, fn, code, maxjump);
+}
+
+#define V_BINCOUNT(b, id, type) CAST(int, (b)->size[id] / sizeof(type))
+
+/* `count' items from `first' must be within section `id' */
+static void _checkslice(const V_Reader *r, const V_Bin *b, int id, size_t elsize,
+        uint32_t first, uint32_t count, const char *fname) {
+    uint32_t total = b->size[id] / elsize;
+    if (first > total || count > total - first) {
+        error("%s: %s: section %d overflow: %u+%u of %u", r->file, fname, id, first, count, total);
+    }
+}
+
+/* '\0' terminated string at `off' of the string pool, NULL if it isn't */
+static const char* _binstr(const V_Bin *b, uint32_t off, uint32_t len) {
+    uint32_t size = b->size[B_SEC_STRS];
+    if (off >= size || len >= size - off) {
+        return NULL;
+    }
+    const char *s = CAST(const char*, b->sec[B_SEC_STRS]) + off;
+    return s[len] == '\0' ? s : NULL;
+}
+
+/* what V_load needs of a function: name, frame size, where its body is */
+static void _loadhead_v2(const V_Reader *r, const V_Bin *b, V_Func *fn, int idx) {
+    const B_Func *bf = CAST(const B_Func*, b->sec[B_SEC_FUNCS]) + idx;
+
+    /* NAME */
+    uint32_t size = b->size[B_SEC_STRS];
+    const char *name = bf->name < size ? CAST(const char*, b->sec[B_SEC_STRS]) + bf->name : NULL;
+    size_t n = name != NULL ? strnlen(name, size - bf->name) : 0;
+    if (name == NULL || n == size - bf->name || n >= MAX_NAME_LEN) {
+        error("%s: bad name of function %d", r->file, idx);
+    }
+    memcpy(fn->name, name, n);
+
+    fn->param = bf->param;
+    fn->regcount = bf->regcount;
+    if (fn->param > fn->regcount) {
+        error("%s: %s: %d params but %d regs", r->file, fn->name, fn->param, fn->regcount);
+    }
+
+    _checkslice(r, b, b->sec[B_SEC_KREFS] != NULL ? B_SEC_KREFS : B_SEC_CONSTS, sizeof(uint32_t),
+            bf->kfirst, bf->kcount, fn->name);
+    _checkslice(r, b, B_SEC_SUBFS, sizeof(uint32_t), bf->sfirst, bf->scount, fn->name);
+    _checkslice(r, b, B_SEC_CODE, sizeof(uint32_t), bf->codefirst, bf->codecount, fn->name);
+    fn->lazy = bf;
+}
+
+/* constant `idx' of the file, made once for all the functions using it */
+static const Value* _getconst(V_State *vs, const V_Reader *r, uint32_t idx) {
+    Value *k = &vs->k.values[idx];
+    if (VAL_TYPE(k) != VT_NIL) {
+        return k;
+    }
+    const V_Bin *b = &vs->secs;
+    const B_Const *bk = CAST(const B_Const*, b->sec[B_SEC_CONSTS]) + idx;
+    switch (bk->type) {
+        case VT_INT: {SET_INT(k, bk->u.n);} break;
+        case VT_FLOAT: {SET_FLOAT(k, bk->u.f);} break;
+        case VT_STRING: {
+            const char *s = _binstr(b, bk->u.str, bk->len);
+            if (s == NULL) {
+                error("%s: bad string constant %u", r->file, idx);
+            }
+            SET_STR(k, gc_borrowstr(vs, s, bk->len));
+            gc_barrierroot(vs, k);
+        } break;
+        default: {error("unexpected const value type: %u", bk->type);} break;
+    }
+    return k;
+}
+
+static void _loadbody_v2(V_State *vs, const V_Reader *r, V_Func *fn) {
+    const V_Bin *b = &vs->secs;
+    const B_Func *bf = fn->lazy;
+    int fcount = V_BINCOUNT(b, B_SEC_FUNCS, B_Func);
+    fn->lazy = NULL;
+
+    /* CONSTS, copied from the shared ones; a v2 file has its own run of them */
+    fn->k.count = bf->kcount;
+    if (fn->k.count > 0) {
+        const uint32_t *refs = NULL;
+        if (b->sec[B_SEC_KREFS] != NULL) {
+            refs = CAST(const uint32_t*, b->sec[B_SEC_KREFS]) + bf->kfirst;
+        }
+        fn->k.values = NEW_ARRAY(Value, fn->k.count);
+        for (int i = 0; i < fn->k.count; ++i) {
+            uint32_t idx = refs != NULL ? refs[i] : bf->kfirst + i;
+            if (idx >= CAST(uint32_t, vs->k.count)) {
+                error("%s: %s: const %d overflow: %u of %d", r->file, fn->name, i, idx, vs->k.count);
+            }
+            copy_value(&fn->k.values[i], _getconst(vs, r, idx));
+        }
+    }
+
+    /* SUBFUNCS */
+    fn->subf.count = bf->scount;
+    if (fn->subf.count > 0) {
+        const uint32_t *subfs = CAST(const uint32_t*, b->sec[B_SEC_SUBFS]) + bf->sfirst;
+        fn->subf.values = NEW_ARRAY(Value, fn->subf.count);
+        for (int i = 0; i < fn->subf.count; ++i) {
+            if (subfs[i] >= CAST(uint32_t, fcount)) {
+                error("%s: subfunc %d overflow: %u of %d", fn->name, i, subfs[i], fcount);
+            }
+            SET_INT(&fn->subf.values[i], subfs[i]);
+        }
+    }
+
+    /* INSTRUCTIONS, one word each, run where they are mapped */
+    uint32_t *code = CAST(uint32_t*, b->sec[B_SEC_CODE]) + bf->codefirst;
+    fn->ins.count = bf->codecount;
+    fn->ins.code = code;
+    int maxjump = 0;
+    for (int i = 0; i < fn->ins.count; ++i) {
+        if (A_GET_OP(code[i]) >= A_NUM_OPCODES) {
+            error("%s: %s: bad opcode %d at %d", r->file, fn->name, A_GET_OP(code[i]), i);
+        }
+        A_Instr ins;
+        A_decode(code[i], &ins);
+        _checkins(r, fn, i, &ins, &maxjump);
+    }
+    _endfunc(vs, r, fn, NULL, maxjump);
+}
+
+/* decode the body of `fn' if V_load left it in the mapping */
+static void _loadlazy(V_State *vs, V_Func *fn) {
+    if (fn->lazy == NULL) {
+        return;
+    }
+    V_Reader r;
+    r.file = vs->binfile;
+    r.base = r.p = CAST(const unsigned char*, vs->bin);
+    r.end = r.base + vs->binsize;
+    _loadbody_v2(vs, &r, fn);
+}
+
+/* v1: functions one after another, each with its own counts */
+static void _load_v1(V_State *vs, V_Reader *r) {
+    int fcount = _rcount(r, "function", 17);
+    if (fcount == 0) {
+        error("no function in %s", r->file);
+    }
+    vs->funcs.count = fcount;
+    vs->funcs.funcs = NEW_ARRAY(V_Func, fcount);
+    for (int i = 0; i < fcount; ++i) {
+        _loadfunc(vs, r, &vs->funcs.funcs[i], fcount);
+    }
+    if (r->p != r->end) {
+        error("load file failed: %ld of %ld", CAST(long, r->p - r->base), CAST(long, r->end - r->base));
+    }
+}
+
+/* v2: section table, then the sections it points to (see lbin.h); bodies are left for _loadlazy */
+static void _load_v2(V_State *vs, V_Reader *r) {
+    uint32_t version = 0, nsections = 0;
+    _rbytes(r, 4);  /* zero */
+    V_READ(r, &version, 4);
+    if (version < 2 || version > B_VERSION) {
+        error("%s: .lbin version %u not supported", r->file, version);
+    }
+    V_READ(r, &nsections, 4);
+    _rbytes(r, 4);  /* reserved */
+    if (nsections > (r->end - r->p) / sizeof(B_Section)) {
+        error("%s: bad section count %u", r->file, nsections);
+    }
+
+    V_Bin *b = &vs->secs;
+    size_t binsize = r->end - r->base;
+    for (uint32_t i = 0; i < nsections; ++i) {
+        B_Section s;
+        V_READ(r, &s, sizeof(s));
+        if (s.id >= B_NUM_SECS) {
+            continue;   /* from a later revision, not needed here */
+        }
+        if (b->sec[s.id] != NULL) {
+            error("%s: section %u given twice", r->file, s.id);
+        }
+        if (s.offset % B_ALIGN != 0 || s.offset > binsize || s.size > binsize - s.offset) {
+            error("%s: bad section %u: %u+%u of %ld", r->file, s.id, s.offset, s.size, CAST(long, binsize));
+        }
+        b->sec[s.id] = r->base + s.offset;
+        b->size[s.id] = s.size;
+    }
+    static const size_t elsizes[B_NUM_SECS] = {
+        1, sizeof(B_Func), sizeof(B_Const), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+    };
+    for (int i = 0; i < B_NUM_SECS; ++i) {
+        if (b->size[i] % elsizes[i] != 0) {
+            error("%s: section %d size %u isn't a multiple of %ld", r->file, i, b->size[i], CAST(long, elsizes[i]));
+        }
+    }
+    if (version >= 3 && b->sec[B_SEC_KREFS] == NULL) {
+        error("%s: no constant refs section", r->file);
+    } else if (version < 3) {
+        b->sec[B_SEC_KREFS] = NULL;
+    }
+    vs->k.count = V_BINCOUNT(b, B_SEC_CONSTS, B_Const);
+    vs->k.values = NEW_ARRAY(Value, vs->k.count);
+    nil_values(vs->k.values, vs->k.count);
+
+    int fcount = V_BINCOUNT(b, B_SEC_FUNCS, B_Func);
+    if (fcount == 0) {
+        error("no function in %s", r->file);
+    }
+    vs->funcs.count = fcount;
+    vs->funcs.funcs = NEW_ARRAY(V_Func, fcount);
+    for (int i = 0; i < fcount; ++i) {
+        _loadhead_v2(r, b, &vs->funcs.funcs[i], i);
+    }
+}
+
+/*
+** The file is mapped, not read: string constants borrow their bytes from
+** the mapping, which lives as long as `vs'.
+*/
+void V_load(V_State *vs, const char *binfile) {
+    int fd = open(binfile, O_RDONLY);
+    if (fd < 0) {
+        error("Load %s failed: %s", binfile, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        error("Load %s failed: %s", binfile, strerror(errno));
+    }
+    if (st.st_size == 0) {
+        error("Load %s failed: empty file", binfile);
+    }
+    /* private and writable: the loader rewrites some instructions in place */
+    void *bin = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bin == MAP_FAILED) {
+        error("Load %s failed: %s", binfile, strerror(errno));
+    }
+    vs->bin = bin;
+    vs->binsize = st.st_size;
+    vs->binfile = strdup(binfile);
+
+    V_Reader r;
+    r.file = binfile;
+    r.base = r.p = CAST(const unsigned char*, bin);
+    r.end = r.base + st.st_size;
+
+    /* HEADER */
+    const char *ident = _rbytes(&r, 4);
+    if (strncmp(ident, "LUNA", 4) != 0) {
+        error("File format not support: `%.4s'", ident);
+    }
+    V_READ(&r, &vs->major, 2);
+    V_READ(&r, &vs->minor, 2);
+
+    /* FUNCTIONS, a v1 file has their count where v2 has 0 */
+    uint32_t tag = 0;
+    memcpy(&tag, _rbytes(&r, 4), 4);
+    r.p -= 4;
+    if (tag == 0) {
+        _load_v2(vs, &r);
+    } else {
+        _load_v1(vs, &r);
+    }
+
+    /* move main to the front, functions before it shift up by one */
+    int mainidx = -1;
+    for (int i = 0; i < vs->funcs.count && mainidx < 0; ++i) {
+        if (strcmp(vs->funcs.funcs[i].name, "main") == 0) {
+            mainidx = i;
+        }
+    }
+    if (mainidx > 0) {
+        V_Func mainfn = vs->funcs.funcs[mainidx];
+        memmove(&vs->funcs.funcs[1], &vs->funcs.funcs[0], mainidx * sizeof(V_Func));
+        vs->funcs.funcs[0] = mainfn;
+    }
+
+    /* other bodies wait for the CLOSURE making them, all of them are dumped when tracing */
+    _loadlazy(vs, &vs->funcs.funcs[0]);
+    if (vs->funcs.funcs[0].nups > 0) {
+        error("%s: main uses %d upvalues", binfile, vs->funcs.funcs[0].nups);
+    }
+    if (!vs->lazy || vs->trace != V_TRACE_OFF) {
+        for (int i = 1; i < vs->funcs.count; ++i) {
+            _loadlazy(vs, &vs->funcs.funcs[i]);
+        }
+    }
+
+    if (vs->trace != V_TRACE_OFF) {
+        _show_status(vs);
+    }
 }
 
 static void _pvalue(const V_State *vs, const Value *v) {
-    switch (v->t) {
-        case VT_INT: {printf("%d\n", v->u.n);} break;
-        case VT_FLOAT: {printf("%lf\n", v->u.f);} break;
-        case VT_STRING: {printf("%s\n", v->u.s);} break;
-        case VT_BOOL: {printf("%s\n", v->u.n == 0 ? "false" : "true");} break;
+    switch (VAL_TYPE(v)) {
+        case VT_INT: {printf("%d\n", VAL_INT(v));} break;
+        case VT_FLOAT: {printf("%lf\n", VAL_FLOAT(v));} break;
+        case VT_STRING: {printf("%.*s\n", VAL_STR(v)->len, VAL_STR(v)->s);} break;
+        case VT_BOOL: {printf("%s\n", VAL_BOOL(v) == 0 ? "false" : "true");} break;
         case VT_NIL: {printf("nil\n");} break;
         case VT_TABLE: {
-            const ltable *lt = v->u.o;
+            const ltable *lt = VAL_OBJ(v);
             int hashcount = 0;
-            for (int i = 0; i < lt->hash->size; ++i) {
-                const list *l = lt->hash->slots[i];
-                hashcount += l->count;
+            for (int i = 0; i < lt->hashsize; ++i) {
+                hashcount += VAL_TYPE(&lt->hash[i].val) != VT_NIL;
             }
             printf("table(%d, %d):%p\n", lt->arraysize, hashcount, lt);
         } break;
         case VT_CLOSURE: {
-            const V_Closure *c = v->u.o;
+            const V_Closure *c = VAL_OBJ(v);
             const V_Func *fn = _get_func(vs, c->fnidx);
             printf("closure(%d):%s\n", c->fnidx, fn->name);
         } break;
-        case VT_CALLINFO: {
-            const V_CallInfo *ci = CAST(V_CallInfo*, v->u.o);
-            printf("ci(%d:%d):%d\n", ci->func, ci->ip, ci->base);
-        } break;
-        default: {error("?(%d)\n", v->t);} break;
+        default: {error("?(%d)\n", VAL_TYPE(v));} break;
     }
 }
 
@@ -235,45 +890,166 @@ static void _pstate(const V_State *vs) {
     printf("  GLOBALS:\n");
     for (int i = 0; i < vs->globals->arraysize; ++i) {
         const Value *v = &vs->globals->array[i];
-        printf("    [%d]\t", i);
+        printf("    [%d]\t", i + 1);
         _pvalue(vs, v);
     }
-    for (int i = 0; i < vs->globals->hash->size; ++i) {
-        const list *l = vs->globals->hash->slots[i];
-        for (lnode *n = l->head; n != NULL; n = n->next) {
-            const hnode *hn = CAST(const hnode*, n->data);
-            printf("    [\"%s\"]\t", hn->key);
-            const Value *v = CAST(const Value*, hn->value);
-            _pvalue(vs, v);
+    for (int i = 0; i < vs->globals->hashsize; ++i) {
+        const tnode *n = &vs->globals->hash[i];
+        if (VAL_TYPE(&n->val) == VT_NIL) {
+            continue;
+        }
+        switch (VAL_TYPE(&n->key)) {
+            case VT_STRING: {printf("    [\"%.*s\"]\t", VAL_STR(&n->key)->len, VAL_STR(&n->key)->s);} break;
+            case VT_INT: {printf("    [%d]\t", VAL_INT(&n->key));} break;
+            default: {printf("    [<%d>]\t", VAL_TYPE(&n->key));} break;
         }
+        _pvalue(vs, &n->val);
     }
 
     printf("}\n\n");
 }
 
-#define Kst(x) (-x - 1)
+static void _pgc(const V_State *vs) {
+    const V_GC *g = &vs->gc;
+    printf("GC: %zu bytes in use, %zu allocated, %zu freed, %lu cycles, %lu steps\n",
+        g->totalbytes, g->allocated, g->freed, g->cycles, g->steps);
+}
+
+
+#define V_FIELDS_PER_FLUSH 50   /* LFIELDS_PER_FLUSH of SETLIST */
+
+static void _settable(V_State *vs, ltable *t, const Value *key, const Value *v) {
+    gc_barriert(vs, t, key);
+    gc_barriert(vs, t, v);
+    long grown = ltable_set(t, key, v);
+    if (grown != 0) {
+        gc_resize(vs, grown);
+        gc_check(vs);
+    }
+}
+
+/* remember where the constant `key' lives in `t', if it has a slot */
+static int _icfill(V_ICache *ic, const ltable *t, const Value *key) {
+    if (VAL_TYPE(key) != VT_STRING) {
+        return 0;
+    }
+    int slot = ltable_slotstr(t, VAL_STR(key));
+    if (slot < 0) {
+        return 0;
+    }
+    ic->shape = t->shape;
+    ic->slot = slot;
+    return 1;
+}
 
-static Value* RK(V_State *vs, V_Func *fn, int x) {
-    if (x < 0) {
-        return &fn->k.values[Kst(x)];
+/* t[key] for a constant key, NULL if absent */
+static inline const Value* _icget(V_ICache *ic, const ltable *t, const Value *key) {
+    if (ic->shape == t->shape || _icfill(ic, t, key)) {
+        return &t->hash[ic->slot].val;
     }
-    return _get_reg(vs, x);
+    return ltable_get(t, key);
+}
+
+/* t[key] = v for a constant key */
+static inline void _icset(V_State *vs, V_ICache *ic, ltable *t, const Value *key, const Value *v) {
+    if (ic->shape == t->shape) {
+        gc_barriert(vs, t, v);
+        copy_value(&t->hash[ic->slot].val, v);
+        return;
+    }
+    _settable(vs, t, key, v);
+    _icfill(ic, t, key);
 }
 
 static double _get_value_float(const Value *v) {
-    if (v->t == VT_INT) {
-        return CAST(double, v->u.n);
-    } else if (v->t == VT_FLOAT) {
-        return v->u.f;
+    if (VAL_TYPE(v) == VT_INT) {
+        return CAST(double, VAL_INT(v));
+    } else if (VAL_TYPE(v) == VT_FLOAT) {
+        return VAL_FLOAT(v);
     }
-    error("can't cast to float: %d", v->t);
+    error("can't cast to float: %d", VAL_TYPE(v));
     return 0.0;
 }
 
-#define NOT_IMP error("op not imp: %s(%d)", A_opnames[ins->t], ins->t)
+/* an exact result of int arithmetic, kept as int when it fits */
+static inline void _setnum(Value *v, long long n) {
+    if (n >= INT_MIN && n <= INT_MAX) {
+        SET_INT(v, CAST(int, n));
+    } else {
+        SET_FLOAT(v, CAST(double, n));
+    }
+}
+
+/* int op int stays int unless it overflows, anything else is done in double */
+#define V_ARITH(op) do {\
+    const Value *b = RKB();\
+    const Value *c = RKC();\
+    if (VAL_TYPE(b) == VT_INT && VAL_TYPE(c) == VT_INT) {\
+        _setnum(RA(), CAST(long long, VAL_INT(b)) op VAL_INT(c));\
+    } else {\
+        double r = _get_value_float(b) op _get_value_float(c);\
+        SET_FLOAT(RA(), r);\
+    }\
+} while (0)
+
+/* the sign of a % b follows b */
+static void _mod(Value *ra, const Value *b, const Value *c) {
+    if (VAL_TYPE(b) == VT_INT && VAL_TYPE(c) == VT_INT) {
+        int m = VAL_INT(c);
+        if (m == 0) {
+            error("attempt to perform 'n%%0'");
+        }
+        long long r = CAST(long long, VAL_INT(b)) % m;
+        if (r != 0 && (r ^ m) < 0) {
+            r += m;
+        }
+        SET_INT(ra, CAST(int, r));
+    } else {
+        double bf = _get_value_float(b);
+        double cf = _get_value_float(c);
+        double r = fmod(bf, cf);
+        if (r != 0 && (r < 0) != (cf < 0)) {
+            r += cf;
+        }
+        SET_FLOAT(ra, r);
+    }
+}
+
+/* numbers compare by value, ints without going through double */
+#define V_NUMCMP(a, b, op) \
+    (VAL_TYPE(a) == VT_INT && VAL_TYPE(b) == VT_INT\
+        ? VAL_INT(a) op VAL_INT(b)\
+        : _get_value_float(a) op _get_value_float(b))
+
+/* strings are interned, so any non-number compares by identity */
+static int _equal(const Value *a, const Value *b) {
+    ValueType ta = VAL_TYPE(a);
+    ValueType tb = VAL_TYPE(b);
+    if ((ta == VT_INT || ta == VT_FLOAT) && (tb == VT_INT || tb == VT_FLOAT)) {
+        return V_NUMCMP(a, b, ==);
+    }
+    if (ta != tb) {
+        return 0;
+    }
+    switch (ta) {
+        case VT_NIL: {return 1;}
+        case VT_BOOL: {return VAL_BOOL(a) == VAL_BOOL(b);}
+        default: {return VAL_OBJ(a) == VAL_OBJ(b);}
+    }
+}
+
+#define NOT_IMP error("op not imp: %s(%d)", A_opnames[OPC()], OPC())
 
-static void _printins(const V_State *vs, const A_Instr *ins) {
-    printf("<%s", A_opnames[ins->t]);
+static void _printins(const V_State *vs, uint32_t word) {
+    A_Instr instr;
+    const A_Instr *ins = &instr;
+    int op = A_GET_OP(word);
+    if (op >= A_NUM_OPCODES) {
+        /* decoded as what it stands for */
+        A_SET_OP(word, V_ops[op - A_NUM_OPCODES].op);
+    }
+    A_decode(word, &instr);
+    printf("<%s", op >= A_NUM_OPCODES ? V_ops[op - A_NUM_OPCODES].name : A_opnames[ins->t]);
     const A_OpMode *om = &A_OpModes[ins->t];
     if (om->a != OpArgN) {
         printf(" %d", ins->a);
@@ -305,450 +1081,788 @@ static Value* _get_stack(const V_State *vs, int idx) {
     return &vs->stk.values[idx];
 }
 
-static Value* _get_reg(const V_State *vs, int idx) {
-    const V_Stack *stk = &vs->stk;
-    int regidx = vs->curci->base + 1 + idx;
-    if (regidx >= stk->size) {
-        error("stack overflow: %d of %d", regidx, stk->size);
+/*
+** Make room for `top' slots. The stack may move: pointers into it must be
+** reloaded afterwards, except the ones upvalues hold, which are fixed here.
+*/
+static void _checkstack(V_State *vs, int top) {
+    if (top <= vs->stk.size) {
+        return;
+    }
+    if (top > V_MAX_STACK) {
+        error("stack overflow: %d of %d", top, V_MAX_STACK);
+    }
+
+    int size = 2 * vs->stk.size;
+    if (size < top) {
+        size = top;
+    }
+    if (size > V_MAX_STACK) {
+        size = V_MAX_STACK;
+    }
+
+    Value *old = vs->stk.values;
+    vs->stk.values = NEW_ARRAY(Value, size);
+    memcpy(vs->stk.values, old, vs->stk.size * sizeof(Value));
+    nil_values(vs->stk.values + vs->stk.size, size - vs->stk.size);
+    vs->stk.size = size;
+
+    for (V_UpVal *uv = vs->openuv; uv != NULL; uv = uv->next) {
+        uv->v = vs->stk.values + (uv->v - old);
     }
-    return &stk->values[regidx];
+    FREE(old);
 }
 
-static void _exec_step(V_State *vs) {
-    V_Func *fn = _get_curfunc(vs);
-    const A_Instr *ins = &fn->ins.instrs[vs->curci->ip];
-    _printins(vs, ins);
+/* the open upvalue of stack slot `v', made if there's none yet */
+static V_UpVal* _findupval(V_State *vs, Value *v) {
+    V_UpVal **p = &vs->openuv;
+    for (; *p != NULL && (*p)->v >= v; p = &(*p)->next) {
+        if ((*p)->v == v) {
+            return *p;
+        }
+    }
+    V_UpVal *uv = NEW(V_UpVal);
+    uv->gctype = VT_UPVAL;
+    uv->v = v;
+    uv->next = *p;
+    *p = uv;
+    gc_link(vs, CAST(GCObject*, uv));
+    return uv;
+}
 
-    switch (ins->t) {
-        case OP_MOVE: {
-            copy_value(_get_reg(vs, ins->a), _get_reg(vs, ins->u.bc.b));
-        } break;
+/* slots from `level' up are going away, their upvalues keep the values */
+static void _closeupvals(V_State *vs, const Value *level) {
+    while (vs->openuv != NULL && vs->openuv->v >= level) {
+        V_UpVal *uv = vs->openuv;
+        vs->openuv = uv->next;
+        copy_value(&uv->value, uv->v);
+        uv->v = &uv->value;
+        gc_barrier(vs, uv, uv->v);
+    }
+}
 
-        case OP_LOADK: {
-            copy_value(_get_reg(vs, ins->a), &fn->k.values[Kst(ins->u.bx)]);
-        } break;
+/*
+** The interpreter core. ip, base, constants and instructions of the running
+** function live in locals and are only written back to `curci' when a call,
+** return or trace needs them. With GCC it dispatches through a label table
+** (computed goto), otherwise through a plain switch; build with
+** -DV_NO_JUMPTABLE to force the switch.
+*/
+#if defined(__GNUC__) && !defined(V_NO_JUMPTABLE)
+#define V_USE_JUMPTABLE 1
+#else
+#define V_USE_JUMPTABLE 0
+#endif
+
+#define V_OP_TRACE V_NUM_OPCODES   /* pseudo opcode for traced dispatch */
+
+/* fields of the running instruction `ins', see lasm.h for the layout */
+#define OPC() A_GET_OP(ins)
+#define ARGA() A_GETARG_A(ins)
+#define ARGB() A_GETARG_B(ins)
+#define ARGC() A_GETARG_C(ins)
+#define ARGBx() A_GETARG_Bx(ins)
+#define ARGsBx() A_GETARG_sBx(ins)
+
+#define RA() (base + ARGA())
+#define RB() (base + ARGB())
+#define RC() (base + ARGC())
+#define RKB() (A_ISK(ARGB()) ? k + A_INDEXK(ARGB()) : base + ARGB())
+#define RKC() (A_ISK(ARGC()) ? k + A_INDEXK(ARGC()) : base + ARGC())
+#define KBx() (k + ARGBx())
+#define IC() (icache + (pc - 1 - code))
+
+#define savepc() (ci->ip = CAST(int, pc - code))
+#define loadframe() do {\
+    ci = vs->curci;\
+    fn = _get_func(vs, ci->func);\
+    code = fn->ins.code;\
+    icache = fn->ic;\
+    k = fn->k.values;\
+    base = vs->stk.values + ci->base + 1;\
+    cl = ci->cl;\
+    pc = code + ci->ip;\
+} while (0)
+
+#define vmfetch() (ins = *pc++)
+
+/* vmgoto(l) goes on with the next instruction, known to be `l' */
+#if V_USE_JUMPTABLE
+#define vmdispatch(o) goto *disp[o];
+#define vmcase(l) L_##l:
+#define vmbreak vmfetch(); vmdispatch(OPC())
+#define vmgoto(l) vmfetch(); goto L_##l
+#else
+#define vmdispatch(o) op = disp[o]; redispatch: switch (op)
+#define vmcase(l) case l:
+#define vmbreak break
+#define vmgoto(l) vmfetch(); op = l; goto redispatch
+#endif
+
+/* branch of a compare fused with the JMP after it: skip the JMP or take it */
+#define V_CMPJMP(cond) do {\
+    if ((cond) != ARGA()) {\
+        ++pc;\
+    } else {\
+        pc += A_GETARG_sBx(*pc) + 1;\
+    }\
+} while (0)
+
+#define V_GETTABLE() do {\
+    Value *a = RA();\
+    const Value *b = RB();\
+    V_CHECKTYPE(b, VT_TABLE);\
+    if (A_ISK(ARGC())) {\
+        copy_value(a, _icget(IC(), VAL_OBJ(b), RKC()));\
+    } else {\
+        copy_value(a, ltable_get(VAL_OBJ(b), RKC()));\
+    }\
+} while (0)
 
-        case OP_LOADBOOL: {
-            Value src;
-            src.t = VT_BOOL;
-            src.u.n = ins->u.bc.b != 0;
-            copy_value(_get_reg(vs, ins->a), &src);
-            if (ins->u.bc.c) {
-                ++vs->curci->ip;
+/*
+** Numeric for loops, Lua 5.4 style: FORPREP checks the loop runs at all and
+** falls into the body, FORLOOP steps and jumps back. An int loop counts its
+** iterations down in R(A+1) instead of comparing against the limit, so it
+** can't overflow and handles either sign of step alike.
+*/
+static int _forprepi(Value *ra) {
+    int init = VAL_INT(ra);
+    int step = VAL_INT(ra + 2);
+    int limit;
+    if (step == 0) {
+        error("'for' step is zero");
+    }
+    if (VAL_TYPE(ra + 1) == VT_INT) {
+        limit = VAL_INT(ra + 1);
+    } else {
+        double fl = _get_value_float(ra + 1);
+        if (fl != fl) {
+            return 0;
+        }
+        fl = step > 0 ? floor(fl) : ceil(fl);
+        limit = fl >= INT_MAX ? INT_MAX : fl <= INT_MIN ? INT_MIN : CAST(int, fl);
+    }
+    if (step > 0 ? init > limit : init < limit) {
+        return 0;
+    }
+    unsigned int count = step > 0
+        ? (CAST(unsigned int, limit) - CAST(unsigned int, init)) / CAST(unsigned int, step)
+        : (CAST(unsigned int, init) - CAST(unsigned int, limit)) / (0u - CAST(unsigned int, step));
+    SET_INT(ra + 1, CAST(int, count));
+    SET_INT(ra + 3, init);
+    return 1;
+}
+
+static int _forprepf(Value *ra) {
+    double init = _get_value_float(ra);
+    double limit = _get_value_float(ra + 1);
+    double step = _get_value_float(ra + 2);
+    if (step == 0) {
+        error("'for' step is zero");
+    }
+    SET_FLOAT(ra, init);
+    SET_FLOAT(ra + 1, limit);
+    SET_FLOAT(ra + 2, step);
+    SET_FLOAT(ra + 3, init);
+    return step > 0 ? init <= limit : limit <= init;
+}
+
+#define V_FORLOOPI(ra) do {\
+    unsigned int count = CAST(unsigned int, VAL_INT((ra) + 1));\
+    if (count > 0) {\
+        int idx = CAST(int, CAST(unsigned int, VAL_INT(ra)) + CAST(unsigned int, VAL_INT((ra) + 2)));\
+        SET_INT((ra) + 1, CAST(int, count - 1));\
+        SET_INT(ra, idx);\
+        SET_INT((ra) + 3, idx);\
+        pc += ARGsBx();\
+    }\
+} while (0)
+
+#define V_FORLOOPF(ra) do {\
+    double step = VAL_FLOAT((ra) + 2);\
+    double idx = VAL_FLOAT(ra) + step;\
+    if (step > 0 ? idx <= VAL_FLOAT((ra) + 1) : VAL_FLOAT((ra) + 1) <= idx) {\
+        SET_FLOAT(ra, idx);\
+        SET_FLOAT((ra) + 3, idx);\
+        pc += ARGsBx();\
+    }\
+} while (0)
+
+static void _execute(V_State *vs) {
+#if V_USE_JUMPTABLE
+    static const void *const optab[V_NUM_OPCODES] = {
+        &&L_OP_MOVE, &&L_OP_LOADK, &&L_OP_LOADBOOL, &&L_OP_LOADNIL,
+        &&L_OP_GETUPVAL, &&L_OP_GETGLOBAL, &&L_OP_GETTABLE, &&L_OP_SETGLOBAL,
+        &&L_OP_SETUPVAL, &&L_OP_SETTABLE, &&L_OP_NEWTABLE, &&L_OP_SELF,
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD, &&L_OP_POW,
+        &&L_OP_UNM, &&L_OP_NOT, &&L_OP_LEN, &&L_OP_CONCAT, &&L_OP_JMP,
+        &&L_OP_EQ, &&L_OP_LT, &&L_OP_LE, &&L_OP_TEST, &&L_OP_TESTSET,
+        &&L_OP_CALL, &&L_OP_TAILCALL, &&L_OP_RETURN, &&L_OP_FORLOOP,
+        &&L_OP_FORPREP, &&L_OP_TFORLOOP, &&L_OP_SETLIST, &&L_OP_CLOSE,
+        &&L_OP_CLOSURE, &&L_OP_VARARG,
+        &&L_V_OP_FORPREPI, &&L_V_OP_FORLOOPI, &&L_V_OP_FORPREPF, &&L_V_OP_FORLOOPF,
+        &&L_V_OP_EQJMP, &&L_V_OP_LTJMP, &&L_V_OP_LEJMP, &&L_V_OP_LOADKADD,
+        &&L_V_OP_GETGLOBALCALL, &&L_V_OP_GETTABLE2,
+    };
+    const void *disp[V_NUM_OPCODES];
+    for (int i = 0; i < V_NUM_OPCODES; ++i) {
+        disp[i] = optab[i];
+    }
+#define V_SETTRACE(o) disp[o] = &&L_V_OP_TRACE
+#else
+    unsigned char disp[V_NUM_OPCODES];
+    for (int i = 0; i < V_NUM_OPCODES; ++i) {
+        disp[i] = i;
+    }
+    int op;
+#define V_SETTRACE(o) disp[o] = V_OP_TRACE
+#endif
+
+    /* tracing only costs anything for the opcodes being traced */
+    if (vs->trace == V_TRACE_INS) {
+        for (int i = 0; i < V_NUM_OPCODES; ++i) {
+            V_SETTRACE(i);
+        }
+    } else if (vs->trace == V_TRACE_CALL) {
+        V_SETTRACE(OP_CALL);
+        V_SETTRACE(OP_TAILCALL);
+        V_SETTRACE(OP_RETURN);
+    }
+#undef V_SETTRACE
+
+    V_CallInfo *ci;
+    V_Func *fn;
+    const uint32_t *code;
+    const uint32_t *pc;
+    uint32_t ins;
+    V_ICache *icache;
+    V_Closure *cl;
+    Value *k;
+    Value *base;
+    loadframe();
+
+    for (;;) {
+        vmfetch();
+        vmdispatch(OPC()) {
+            vmcase(V_OP_TRACE) {
+                ci->ip = CAST(int, pc - 1 - code);
+                _pstate(vs);
+                _printins(vs, ins);
+#if V_USE_JUMPTABLE
+                goto *optab[OPC()];
+#else
+                op = OPC();
+                goto redispatch;
+#endif
             }
-        } break;
 
-        case OP_LOADNIL: {
-            Value src;
-            src.t = VT_NIL;
-            for (int i = ins->a; i <= ins->u.bc.b; ++i) {
-                copy_value(_get_reg(vs, i), &src);
+            vmcase(OP_MOVE) {
+                copy_value(RA(), RB());
+                vmbreak;
             }
-        } break;
 
-        case OP_GETUPVAL: {
-            const Value *v = &vs->cl->uv.values[ins->u.bc.b];
-            if (v->t == VT_VALUEP) {
-                v = v->u.o;
+            vmcase(OP_LOADK) {
+                copy_value(RA(), KBx());
+                vmbreak;
             }
-            copy_value(_get_reg(vs, ins->a), v);
-        } break;
 
-        case OP_GETGLOBAL: {
-            const Value *k = &fn->k.values[Kst(ins->u.bx)];
-            if (k->t != VT_STRING) {
-                error("string expected by GETGLOBAL, got %d", k->t);
+            vmcase(OP_LOADBOOL) {
+                Value src;
+                SET_BOOL(&src, ARGB() != 0);
+                copy_value(RA(), &src);
+                if (ARGC()) {
+                    ++pc;
+                }
+                vmbreak;
             }
 
-            const void *data = ltable_gettable(vs->globals, k->u.s);
-            Value *a = _get_reg(vs, ins->a);
-            if (data == NULL) {
-                Value r;
-                r.t = VT_NIL;
-                copy_value(a, &r);
-            } else {
-                const Value *r = CAST(const Value*, data);
-                copy_value(a, r);
+            vmcase(OP_LOADNIL) {
+                Value src;
+                SET_NIL(&src);
+                for (int i = ARGA(); i <= ARGB(); ++i) {
+                    copy_value(base + i, &src);
+                }
+                vmbreak;
             }
-        } break;
 
-        case OP_GETTABLE: {
-            Value *a = _get_reg(vs, ins->a);
-            const Value *b = _get_reg(vs, ins->u.bc.b);
-            V_CHECKTYPE(b, VT_TABLE);
-            const Value *c = RK(vs, fn, ins->u.bc.c);
-            V_CHECKTYPE(c, VT_STRING);
-            const Value *v = ltable_gettable(b->u.o, c->u.s);
-            if (v == NULL) {
-                Value nil;
-                nil.t = VT_NIL;
-                copy_value(a, &nil);
-            } else {
-                copy_value(a, v);
+            vmcase(OP_GETUPVAL) {
+                copy_value(RA(), cl->uv[ARGB()]->v);
+                vmbreak;
             }
-        } break;
 
-        case OP_SETGLOBAL: {
-            int idx = Kst(ins->u.bx);
-            const Value *k = &fn->k.values[idx];
-            if (k->t != VT_STRING) {
-                error("string expected by SETGLOBAL, got %d idx %d(%d)", k->t, idx, ins->u.bx);
+            vmcase(OP_GETGLOBAL) {
+                copy_value(RA(), _icget(IC(), vs->globals, KBx()));
+                vmbreak;
             }
-            
-            const Value *a = _get_reg(vs, ins->a);
-            ltable_settable(vs->globals, k->u.s, a);
-        } break;
 
-        case OP_SETUPVAL: {
-            Value *v = &vs->cl->uv.values[ins->u.bc.b];
-            V_CHECKTYPE(v, VT_VALUEP);
-            copy_value(v->u.o, _get_reg(vs, ins->a));
-        } break;
+            vmcase(OP_GETTABLE) {
+                V_GETTABLE();
+                vmbreak;
+            }
 
-        case OP_SETTABLE: {
-            Value *a = _get_reg(vs, ins->a);
-            V_CHECKTYPE(a, VT_TABLE);
-            const Value *b = RK(vs, fn, ins->u.bc.b);
-            V_CHECKTYPE(b, VT_STRING);
-            const Value *c = RK(vs, fn, ins->u.bc.c);
-            ltable_settable(a->u.o, b->u.s, c);
-        } break;
+            vmcase(OP_SETGLOBAL) {
+                _icset(vs, IC(), vs->globals, KBx(), RA());
+                vmbreak;
+            }
 
-        case OP_NEWTABLE: {
-            Value v;
-            v.t = VT_TABLE;
-            v.u.o = ltable_new(ins->u.bc.b);    /* TODO: param `c' not used */
-            copy_value(_get_reg(vs, ins->a), &v);
-        } break;
+            vmcase(OP_SETUPVAL) {
+                V_UpVal *uv = cl->uv[ARGB()];
+                gc_barrier(vs, uv, RA());
+                copy_value(uv->v, RA());
+                vmbreak;
+            }
 
-        case OP_SELF: {
-            const Value *b = _get_reg(vs, ins->u.bc.b);
-            V_CHECKTYPE(b, VT_TABLE);
+            vmcase(OP_SETTABLE) {
+                Value *a = RA();
+                V_CHECKTYPE(a, VT_TABLE);
+                if (A_ISK(ARGB())) {
+                    _icset(vs, IC(), VAL_OBJ(a), RKB(), RKC());
+                } else {
+                    _settable(vs, VAL_OBJ(a), RKB(), RKC());
+                }
+                vmbreak;
+            }
 
-            copy_value(_get_reg(vs, ins->a + 1), b);
+            vmcase(OP_NEWTABLE) {
+                ltable *t = ltable_new(_fb2int(ARGB()), _fb2int(ARGC()));
+                gc_link(vs, CAST(GCObject*, t));
+                Value v;
+                SET_OBJ(&v, VT_TABLE, t);
+                copy_value(RA(), &v);
+                gc_check(vs);
+                vmbreak;
+            }
 
-            const Value *c = RK(vs, fn, ins->u.bc.c);
-            const Value *v = ltable_gettable(b->u.o, c->u.s);
-            copy_value(_get_reg(vs, ins->a), v);
-        } break;
+            vmcase(OP_SELF) {
+                const Value *b = RB();
+                V_CHECKTYPE(b, VT_TABLE);
 
-        case OP_ADD:
-        case OP_SUB:
-        case OP_MUL:
-        case OP_DIV:
-        case OP_MOD:
-        case OP_POW: {
-            const Value *b = RK(vs, fn, ins->u.bc.b);
-            const Value *c = RK(vs, fn, ins->u.bc.c);
-            double bf = _get_value_float(b);
-            double cf = _get_value_float(c);
-            double ca = 0.0;
-            Value v;
-            v.t = VT_FLOAT;
-            switch (ins->t) {
-                case OP_ADD: {ca = bf + cf;} break;
-                case OP_SUB: {ca = bf - cf;} break;
-                case OP_MUL: {ca = bf * cf;} break;
-                case OP_DIV: {ca = bf / cf;} break;
-                case OP_MOD: {
-                    if (b->t != VT_INT || c->t != VT_INT) {
-                        error("op mod only support int, got: %d, %d", b->t, c->t);
-                    }
-                    v.t = VT_INT;
-                    ca = (int)bf % (int)cf;
-                } break;
-                case OP_POW: {
-                    if (b->t != VT_INT || c->t != VT_INT) {
-                        error("op mod only support int, got: %d, %d", b->t, c->t);
-                    }
-                    v.t = VT_INT;
-                    ca = (int)bf ^ (int)cf;
-                } break;
-                default: {
-                    error("impossible: %d", ins->t);
-                } break;
+                copy_value(RA() + 1, b);
+
+                if (A_ISK(ARGC())) {
+                    copy_value(RA(), _icget(IC(), VAL_OBJ(b), RKC()));
+                } else {
+                    copy_value(RA(), ltable_get(VAL_OBJ(b), RKC()));
+                }
+                vmbreak;
             }
-            if (v.t == VT_INT) {
-                v.u.n = (int)ca;
-            } else {
-                v.u.f = ca;
+
+            vmcase(OP_ADD) {
+                V_ARITH(+);
+                vmbreak;
             }
-            copy_value(_get_reg(vs, ins->a), &v);
-        } break;
 
-        case OP_UNM: {
-            Value v;
-            copy_value(&v, _get_reg(vs, ins->u.bc.b));
-            if (v.t == VT_INT) {
-                v.u.n = -v.u.n;
-            } else if (v.t == VT_FLOAT) {
-                v.u.f = -v.u.f;
-            } else {
-                error("value type error: %d", v.t);
-            }
-            copy_value(_get_reg(vs, ins->a), &v);
-        } break;
+            vmcase(OP_SUB) {
+                V_ARITH(-);
+                vmbreak;
+            }
 
-        case OP_NOT: {
-            Value v;
-            v.t = VT_BOOL;
-            const Value *b = _get_reg(vs, ins->u.bc.b);
-            switch (b->t) {
-                case VT_BOOL: {v.u.n = b->u.n == 0;} break;
-                case VT_NIL: {v.u.n = 1;} break;
-                default: {v.u.n = 0;} break;
+            vmcase(OP_MUL) {
+                V_ARITH(*);
+                vmbreak;
             }
-            copy_value(_get_reg(vs, ins->a), &v);
-        } break;
 
-        case OP_LEN: {
-            const Value *b = _get_reg(vs, ins->u.bc.b);
-            V_CHECKTYPE(b, VT_TABLE);
-            /* TODO: only support table? */
-            int len = ltable_len(b->u.o);
-            Value v;
-            v.t = VT_INT;
-            v.u.n = len;
-            copy_value(_get_reg(vs, ins->a), &v);
-        } break;
+            vmcase(OP_DIV) {
+                double r = _get_value_float(RKB()) / _get_value_float(RKC());
+                SET_FLOAT(RA(), r);
+                vmbreak;
+            }
+
+            vmcase(OP_MOD) {
+                _mod(RA(), RKB(), RKC());
+                vmbreak;
+            }
 
-        case OP_CONCAT: {
-            int maxlen = 128; /* TODO: better value? */
-            int curlen = 0;
-            char *buff = NEW_ARRAY(char, maxlen);
-            for (int i = ins->u.bc.b; i <= ins->u.bc.c; ++i) {
-                const Value *v = _get_reg(vs, i);
-                V_CHECKTYPE(v, VT_STRING);
-                const char *s = v->u.s;
-                int len = strlen(s);
-                if (curlen + len >= maxlen) {
-                    maxlen = 2 * (curlen + len);
-                    buff = realloc(buff, maxlen);
+            vmcase(OP_POW) {
+                double r = pow(_get_value_float(RKB()), _get_value_float(RKC()));
+                SET_FLOAT(RA(), r);
+                vmbreak;
+            }
+
+            vmcase(OP_UNM) {
+                Value v;
+                SET_NIL(&v);
+                const Value *b = RB();
+                if (VAL_TYPE(b) == VT_INT) {
+                    _setnum(&v, -CAST(long long, VAL_INT(b)));
+                } else if (VAL_TYPE(b) == VT_FLOAT) {
+                    SET_FLOAT(&v, -VAL_FLOAT(b));
+                } else {
+                    error("value type error: %d", VAL_TYPE(b));
                 }
-                strcpy(buff + curlen, s);
-                curlen += len;
-            }
-            Value vnew;
-            vnew.t = VT_STRING;
-            vnew.u.s = buff;
-            copy_value(_get_reg(vs, ins->a), &vnew);
-            FREE(buff);
-        } break;
+                copy_value(RA(), &v);
+                vmbreak;
+            }
 
-        case OP_JMP: {
-            vs->curci->ip += ins->u.bx;
-        } break;
+            vmcase(OP_NOT) {
+                Value v;
+                const Value *b = RB();
+                switch (VAL_TYPE(b)) {
+                    case VT_BOOL: {SET_BOOL(&v, VAL_BOOL(b) == 0);} break;
+                    case VT_NIL: {SET_BOOL(&v, 1);} break;
+                    default: {SET_BOOL(&v, 0);} break;
+                }
+                copy_value(RA(), &v);
+                vmbreak;
+            }
 
-        case OP_EQ:
-        case OP_LT:
-        case OP_LE: {
-            const Value *b = RK(vs, fn, ins->u.bc.b);
-            const Value *c = RK(vs, fn, ins->u.bc.c);
-            float bf = _get_value_float(b);
-            float cf = _get_value_float(c);
-            int result = 0;
-            switch (ins->t) {
-                case OP_EQ: {result = (bf == cf) != ins->a;} break;
-                case OP_LT: {result = (bf < cf) != ins->a;} break;
-                case OP_LE: {result = (bf <= cf) != ins->a;} break;
-                default: {error("impossible: %d", ins->t);} break;
-            }
-            if (result) {
-                ++vs->curci->ip;
+            vmcase(OP_LEN) {
+                const Value *b = RB();
+                V_CHECKTYPE(b, VT_TABLE);
+                /* TODO: only support table? */
+                Value v;
+                SET_INT(&v, ltable_len(VAL_OBJ(b)));
+                copy_value(RA(), &v);
+                vmbreak;
             }
-        } break;
 
-        case OP_TEST: {
-            /* if not (R(A) <=> C) then pc++ */
-            /* TODO: what does the `<=>' mean? I just consider it to `=='*/
-            int a = (int)_get_value_float(_get_reg(vs, ins->a));
-            if (a != ins->u.bc.c) {++vs->curci->ip;}
-        } break;
+            vmcase(OP_CONCAT) {
+                int totallen = 0;
+                for (int i = ARGB(); i <= ARGC(); ++i) {
+                    const Value *v = base + i;
+                    V_CHECKTYPE(v, VT_STRING);
+                    totallen += VAL_STR(v)->len;
+                }
+                char *buff = NEW_SIZE(char, totallen + 1);
+                int curlen = 0;
+                for (int i = ARGB(); i <= ARGC(); ++i) {
+                    const LString *ls = VAL_STR(base + i);
+                    memcpy(buff + curlen, ls->s, ls->len);
+                    curlen += ls->len;
+                }
+                Value vnew;
+                SET_STR(&vnew, gc_newstr(vs, buff, totallen));
+                copy_value(RA(), &vnew);
+                FREE(buff);
+                gc_check(vs);
+                vmbreak;
+            }
 
-        case OP_TESTSET: {
-            /* TODO: as OP_TEST, confusing `<=>' */
-            int b = (int)_get_value_float(_get_reg(vs, ins->u.bc.b));
-            if (b == ins->u.bc.c) {
-                copy_value(_get_reg(vs, ins->a), _get_reg(vs, ins->u.bc.b));
-            } else {
-                ++vs->curci->ip;
+            vmcase(OP_JMP) {
+                pc += ARGsBx();
+                vmbreak;
             }
-        } break;
 
-        case OP_CALL: {
-            const Value *a = _get_reg(vs, ins->a);
-            V_CHECKTYPE(a, VT_CLOSURE);
-            V_Closure *cl = a->u.o;
-            vs->cl = cl;
-
-            /* push callee */
-            V_CallInfo *callee = _pushci(vs, cl->fnidx, -1, ins->a, ins->a + ins->u.bc.c - 2);
-
-            /* push params */
-            const V_Func *fn = _get_func(vs, cl->fnidx);
-            if (ins->u.bc.c != 1) {
-                for (int i = 0; i < fn->param; ++i) {
-                    int idx = ins->a + 1 + i;
-                    if (vs->curci->base + 1 + idx >= callee->base) {
-                        _push(vs, NULL);
-                    } else {
-                        _push(vs, _get_reg(vs, ins->a + 1 + i));
-                    }
+            vmcase(OP_EQ) {
+                if (_equal(RKB(), RKC()) != ARGA()) {
+                    ++pc;
                 }
-            } else {    /* vararg */
-                for (int i = ins->a + 1; i < callee->base - 1; ++i) {
-                    _push(vs, _get_reg(vs, i));
+                vmbreak;
+            }
+
+            vmcase(OP_LT) {
+                const Value *b = RKB();
+                const Value *c = RKC();
+                if (V_NUMCMP(b, c, <) != ARGA()) {
+                    ++pc;
                 }
+                vmbreak;
             }
 
-            vs->stk.top = callee->base + fn->regcount + 1;
-            vs->curci = callee;
-        } break;
+            vmcase(OP_LE) {
+                const Value *b = RKB();
+                const Value *c = RKC();
+                if (V_NUMCMP(b, c, <=) != ARGA()) {
+                    ++pc;
+                }
+                vmbreak;
+            }
 
-        case OP_TAILCALL: {
-            const Value *a = _get_reg(vs, ins->a);
-            V_CHECKTYPE(a, VT_CLOSURE);
-            V_Closure *cl = a->u.o;
-            vs->cl = cl;
-
-            /* copy params */
-            const V_Func *fn = _get_func(vs, cl->fnidx);
-            for (int i = 0; i < fn->param; ++i) {
-                int idx = ins->a + 1 + i;
-                if (idx >= vs->stk.top) {
-                    copy_value(_get_reg(vs, i), NULL);
+            vmcase(OP_TEST) {
+                /* if not (R(A) <=> C) then pc++ */
+                /* TODO: what does the `<=>' mean? I just consider it to `=='*/
+                int a = (int)_get_value_float(RA());
+                if (a != ARGC()) {++pc;}
+                vmbreak;
+            }
+
+            vmcase(OP_TESTSET) {
+                /* TODO: as OP_TEST, confusing `<=>' */
+                int b = (int)_get_value_float(RB());
+                if (b == ARGC()) {
+                    copy_value(RA(), RB());
                 } else {
-                    copy_value(_get_reg(vs, i), _get_reg(vs, idx));
+                    ++pc;
                 }
+                vmbreak;
             }
 
-            /* set ci */
-            vs->curci->func = cl->fnidx;
-            vs->curci->ip = -1;
+            vmcase(OP_CALL) {
+                const Value *a = RA();
+                V_CHECKTYPE(a, VT_CLOSURE);
+                const V_Closure *c = VAL_OBJ(a);
+
+                /* the frame and params, varargs are at most the caller's registers */
+                const V_Func *callee_fn = _get_func(vs, c->fnidx);
+                int need = callee_fn->regcount > fn->regcount ? callee_fn->regcount : fn->regcount;
+                _checkstack(vs, vs->stk.top + need + 1);
+                base = vs->stk.values + ci->base + 1;
+                a = RA();
+
+                /* push callee, `ci' may move */
+                savepc();
+                int callerbase = ci->base;
+                V_CallInfo *callee = _pushci(vs, a, c->fnidx, 0, ARGA(), ARGA() + ARGC() - 2);
+
+                /* push params */
+                if (ARGC() != 1) {
+                    for (int i = 0; i < callee_fn->param; ++i) {
+                        int idx = ARGA() + 1 + i;
+                        if (callerbase + 1 + idx >= callee->base) {
+                            _push(vs, NULL);
+                        } else {
+                            _push(vs, base + idx);
+                        }
+                    }
+                } else {    /* vararg */
+                    for (int i = ARGA() + 1; callerbase + 1 + i < callee->base; ++i) {
+                        _push(vs, base + i);
+                    }
+                }
 
-            /* stack */
-            vs->stk.top = vs->curci->base + fn->regcount + 1;
-        } break;
+                vs->stk.top = callee->base + callee_fn->regcount + 1;
+                loadframe();
+                vmbreak;
+            }
+
+            vmcase(OP_TAILCALL) {
+                const Value *a = RA();
+                V_CHECKTYPE(a, VT_CLOSURE);
+                V_Closure *c = VAL_OBJ(a);
+
+                const V_Func *callee_fn = _get_func(vs, c->fnidx);
+                _checkstack(vs, ci->base + callee_fn->regcount + 1);
+                base = vs->stk.values + ci->base + 1;
+                a = RA();
+                if (vs->openuv != NULL) {
+                    _closeupvals(vs, base);
+                }
+
+                /* the frame slot keeps the new closure alive */
+                copy_value(base - 1, a);
+
+                /* copy params */
+                for (int i = 0; i < callee_fn->param; ++i) {
+                    int idx = ARGA() + 1 + i;
+                    if (ci->base + 1 + idx >= vs->stk.top) {
+                        copy_value(base + i, NULL);
+                    } else {
+                        copy_value(base + i, base + idx);
+                    }
+                }
+
+                /* set ci */
+                ci->func = c->fnidx;
+                ci->ip = 0;
+                ci->cl = c;
 
-        case OP_RETURN: {
-            if (vs->curci->func == 0) {
-                /* TODO: better idea? */
-                return;
+                /* stack */
+                vs->stk.top = ci->base + callee_fn->regcount + 1;
+                loadframe();
+                vmbreak;
             }
 
-            V_CallInfo *caller = vs->cis.values[vs->cis.count - 2];
-            int retb = vs->curci->retb;
-            int rete = vs->curci->rete;
+            vmcase(OP_RETURN) {
+                if (vs->openuv != NULL) {
+                    _closeupvals(vs, base);
+                }
+                /* the bottom frame is main, even if it tail called */
+                if (ci == vs->cis.values) {
+                    savepc();
+                    return;
+                }
+
+                const V_CallInfo *caller = ci - 1;
+                int retb = ci->retb;
+                int rete = ci->rete;
+
+                for (int i = retb; i <= rete; ++i) {
+                    int idx = ARGA() + i - retb;
+                    if (idx > ARGA() + ARGB() - 2) { /* TODO: deal with b == 0 */
+                        copy_value(_get_stack(vs, caller->base + 1 + i), NULL);
+                    } else {
+                        copy_value(_get_stack(vs, caller->base + 1 + i), base + idx);
+                    }
+                }
+
+                _popci(vs);
+                loadframe();
+                vmbreak;
+            }
 
-            for (int i = retb; i <= rete; ++i) {
-                int idx = ins->a + i - retb;
-                if (idx > ins->a + ins->u.bc.b - 2) { /* TODO: deal with b == 0 */
-                    copy_value(_get_stack(vs, caller->base + 1 + i), NULL);
+            /* the generic pair, for loops the loader couldn't type */
+            vmcase(OP_FORLOOP) {
+                Value *ra = RA();
+                if (VAL_TYPE(ra + 2) == VT_INT) {
+                    V_FORLOOPI(ra);
                 } else {
-                    copy_value(_get_stack(vs, caller->base + 1 + i), _get_reg(vs, idx));
+                    V_FORLOOPF(ra);
                 }
+                vmbreak;
             }
 
-            _popci(vs);
-        } break;
+            vmcase(OP_FORPREP) {
+                Value *ra = RA();
+                if (VAL_TYPE(ra) == VT_INT && VAL_TYPE(ra + 2) == VT_INT ? !_forprepi(ra) : !_forprepf(ra)) {
+                    pc += ARGsBx() + 1;
+                }
+                vmbreak;
+            }
 
-        case OP_FORLOOP: {
-            float af = _get_value_float(_get_reg(vs, ins->a));
-            float a2f = _get_value_float(_get_reg(vs, ins->a + 2));
-            Value v;
-            v.t = VT_FLOAT;
-            v.u.f = af + a2f;
-            copy_value(_get_reg(vs, ins->a), &v);
+            /* init and step are int constants */
+            vmcase(V_OP_FORLOOPI) {
+                Value *ra = RA();
+                V_FORLOOPI(ra);
+                vmbreak;
+            }
 
-            float a1f = _get_value_float(_get_reg(vs, ins->a + 1));
-            if (v.u.f <= a1f) {
-                vs->curci->ip += ins->u.bx;
-                copy_value(_get_reg(vs, ins->a + 3), &v);
+            vmcase(V_OP_FORPREPI) {
+                if (!_forprepi(RA())) {
+                    pc += ARGsBx() + 1;
+                }
+                vmbreak;
             }
-        } break;
 
-        case OP_FORPREP: {
-            float af = _get_value_float(_get_reg(vs, ins->a));
-            float a2f = _get_value_float(_get_reg(vs, ins->a + 2));
-            Value v;
-            v.t = VT_FLOAT;
-            v.u.f = af - a2f;
-            copy_value(_get_reg(vs, ins->a), &v);
-            vs->curci->ip += ins->u.bx;
-        } break;
+            /* init and step are number constants, one of them float */
+            vmcase(V_OP_FORLOOPF) {
+                Value *ra = RA();
+                V_FORLOOPF(ra);
+                vmbreak;
+            }
 
-        case OP_TFORLOOP: {NOT_IMP;} break;
+            vmcase(V_OP_FORPREPF) {
+                if (!_forprepf(RA())) {
+                    pc += ARGsBx() + 1;
+                }
+                vmbreak;
+            }
 
-        case OP_SETLIST: {
-            for (int i = 1; i <= ins->u.bc.b; ++i) {
-                Value *ra = _get_reg(vs, ins->a);
-                V_CHECKTYPE(ra, VT_TABLE);
-                ltable_setarray(ra->u.o, i - 1, _get_reg(vs, ins->a + i));
+            /* superinstructions, see _fuse */
+            vmcase(V_OP_EQJMP) {
+                V_CMPJMP(_equal(RKB(), RKC()));
+                vmbreak;
             }
-        } break;
 
-        case OP_CLOSE: {NOT_IMP;} break;
+            vmcase(V_OP_LTJMP) {
+                const Value *b = RKB();
+                const Value *c = RKC();
+                V_CMPJMP(V_NUMCMP(b, c, <));
+                vmbreak;
+            }
 
-        case OP_CLOSURE: {
-            V_Func *fn = _get_curfunc(vs);
-            if (ins->u.bx >= fn->subf.count) {
-                error("subfunc idx overflow: %d of %d", ins->u.bx, fn->subf.count);
+            vmcase(V_OP_LEJMP) {
+                const Value *b = RKB();
+                const Value *c = RKC();
+                V_CMPJMP(V_NUMCMP(b, c, <=));
+                vmbreak;
+            }
+
+            vmcase(V_OP_LOADKADD) {
+                copy_value(RA(), KBx());
+                vmgoto(OP_ADD);
+            }
+
+            vmcase(V_OP_GETGLOBALCALL) {
+                copy_value(RA(), _icget(IC(), vs->globals, KBx()));
+                vmgoto(OP_CALL);
             }
 
-            V_Closure *c = NEW(V_Closure);
-            c->fnidx = fn->subf.values[ins->u.bx].u.n;
+            vmcase(V_OP_GETTABLE2) {
+                V_GETTABLE();
+                vmgoto(OP_GETTABLE);
+            }
 
-            /* upvalues */
-            c->uv.count = ins->a;
-            if (ins->a > 0) {
-                c->uv.values = NEW_ARRAY(Value, ins->a);
-                for (int i = 0; i < ins->a; ++i) {
-                    Value *v = &c->uv.values[i];
-                    v->t = VT_VALUEP;
-                    v->u.o = _get_reg(vs, i);
+            vmcase(OP_TFORLOOP) {
+                NOT_IMP;
+                vmbreak;
+            }
+
+            vmcase(OP_SETLIST) {
+                Value *ra = RA();
+                V_CHECKTYPE(ra, VT_TABLE);
+                int first = (ARGC() - 1) * V_FIELDS_PER_FLUSH;
+                for (int i = 1; i <= ARGB(); ++i) {
+                    gc_barriert(vs, VAL_OBJ(ra), ra + i);
+                    gc_resize(vs, ltable_setint(VAL_OBJ(ra), first + i, ra + i));
                 }
+                vmbreak;
             }
 
-            Value v;
-            v.t = VT_CLOSURE;
-            v.u.o = c;
+            vmcase(OP_CLOSE) {
+                _closeupvals(vs, RA());
+                vmbreak;
+            }
 
-            copy_value(_get_reg(vs, ins->a), &v);
-        } break;
+            vmcase(OP_CLOSURE) {
+                int fnidx = VAL_INT(&fn->subf.values[ARGBx()]);
+                V_Func *sub = &vs->funcs.funcs[fnidx];
+
+                /* no call can reach a function before its first closure */
+                _loadlazy(vs, sub);
+
+                V_Closure *c = NEW_SIZE(V_Closure, sizeof(V_Closure) + sub->nups * sizeof(V_UpVal*));
+                c->gctype = VT_CLOSURE;
+                c->fnidx = fnidx;
+                c->nups = sub->nups;
+
+                /* one instruction after it per upvalue, not run: MOVE of a register or GETUPVAL of ours */
+                for (int i = 0; i < c->nups; ++i, ++pc) {
+                    switch (A_GET_OP(*pc)) {
+                        case OP_MOVE: {c->uv[i] = _findupval(vs, base + A_GETARG_B(*pc));} break;
+                        case OP_GETUPVAL: {c->uv[i] = cl->uv[A_GETARG_B(*pc)];} break;
+                        default: {
+                            error("%s: upvalue %d of CLOSURE at %d is neither MOVE nor GETUPVAL",
+                                fn->name, i, CAST(int, pc - code) - i - 1);
+                        } break;
+                    }
+                }
 
-        case OP_VARARG: {
-            for (int i = ins->a + ins->u.bc.b - 1; i>= ins->a; --i) {
-                copy_value(_get_reg(vs, i), _get_reg(vs, i - ins->a));
+                gc_link(vs, CAST(GCObject*, c));
+
+                Value v;
+                SET_OBJ(&v, VT_CLOSURE, c);
+
+                copy_value(RA(), &v);
+                gc_check(vs);
+                vmbreak;
             }
-        } break;
 
-        default: {
-            error("unknown instruction type: %d", ins->t);
-        } break;
-    }
+            vmcase(OP_VARARG) {
+                for (int i = ARGA() + ARGB() - 1; i>= ARGA(); --i) {
+                    copy_value(base + i, base + i - ARGA());
+                }
+                vmbreak;
+            }
 
+#if !V_USE_JUMPTABLE
+            default: {
+                error("unknown instruction type: %d", OPC());
+            } break;
+#endif
+        }
+    }
 }
 
 static V_Func* _get_func(const V_State *vs, int idx) {
-    if (idx < 0 || idx >= vs->funcs->count) {
+    if (idx < 0 || idx >= vs->funcs.count) {
         return NULL;
     }
-    lnode *n = vs->funcs->head;
-    for (int i = 0; i < idx; ++i) {
-        n = n->next;
-    }
-    return CAST(V_Func*, n->data);
+    return &vs->funcs.funcs[idx];
 }
 
 static V_Func* _get_curfunc(const V_State *vs) {
-    if (vs->curci->func >= vs->funcs->count) {
-        error("curci->func overflow: %d of %d", vs->curci->func, vs->funcs->count);
+    if (vs->curci->func >= vs->funcs.count) {
+        error("curci->func overflow: %d of %d", vs->curci->func, vs->funcs.count);
     }
 
     return _get_func(vs, vs->curci->func);
 }
 
+/* callers make room with _checkstack first */
 static void _push(V_State *vs, const Value *v) {
+    if (vs->stk.top >= vs->stk.size) {
+        error("stack overflow: push at %d of %d", vs->stk.top, vs->stk.size);
+    }
     copy_value(&vs->stk.values[vs->stk.top], v);
     ++vs->stk.top;
 }
@@ -757,51 +1871,54 @@ static void _pop(V_State *vs, int n) {
     vs->stk.top -= n;
 }
 
-static V_CallInfo* _newci(int func, int ip, int base, int retb, int rete) {
-    V_CallInfo *ci = NEW(V_CallInfo);
-    ci->func = func;
-    ci->ip = ip;
-    ci->base = base;
-    ci->retb = retb;
-    ci->rete = rete;
-    return ci;
-}
-
-/* return next top */
 static void _popci(V_State *vs) {
     _pop(vs, vs->stk.top - vs->curci->base);
-    vs->curci = vs->cis.values[--vs->cis.count - 1];
+    --vs->cis.count;
+    vs->curci = &vs->cis.values[vs->cis.count - 1];
 }
 
-static V_CallInfo* _pushci(V_State *vs, int func, int ip, int retb, int rete) {
-    V_CallInfo *ci = _newci(func, ip, vs->stk.top, retb, rete);
-    vs->cis.values[vs->cis.count++] = ci;
+/*
+** New frame at the stack top, its first slot keeps the closure `cl' alive.
+** Frames live in one array, pointers to them are only good until the next push.
+*/
+static V_CallInfo* _pushci(V_State *vs, const Value *cl, int func, int ip, int retb, int rete) {
+    V_CallInfoStream *cis = &vs->cis;
+    if (cis->count >= cis->size) {
+        if (cis->count >= cis->max) {
+            error("stack overflow: more than %d calls", cis->max);
+        }
+        int size = 2 * cis->size;
+        if (size > cis->max) {
+            size = cis->max;
+        }
+        cis->values = realloc(cis->values, size * sizeof(V_CallInfo));
+        cis->size = size;
+    }
 
-    Value vci;
-    vci.t = VT_CALLINFO;
-    vci.u.o = ci;
-    _push(vs, &vci);
+    V_CallInfo *ci = &cis->values[cis->count++];
+    ci->func = func;
+    ci->ip = ip;
+    ci->base = vs->stk.top;
+    ci->retb = retb;
+    ci->rete = rete;
+    ci->cl = cl != NULL ? VAL_OBJ(cl) : NULL;
+    vs->curci = ci;
 
+    _push(vs, cl);
     return ci;
 }
 
 void V_run(V_State *vs) {
     /* main */
-    vs->curci = _pushci(vs, 0, 0, 0, 0);
     const V_Func *fn = _get_func(vs, 0);
+    _checkstack(vs, fn->regcount + 1);
+    _pushci(vs, NULL, 0, 0, 0, 0);
     vs->stk.top = fn->regcount + 1;
 
-    _pstate(vs);
-
-    for (;;) {
-        V_Func *fn = _get_curfunc(vs);
-        if (vs->curci->func == 0 && vs->curci->ip >= fn->ins.count) {
-            break;
-        }
-        _exec_step(vs);
+    _execute(vs);
 
-        ++vs->curci->ip;
+    if (vs->trace != V_TRACE_OFF) {
         _pstate(vs);
+        _pgc(vs);
     }
 }
-
@@ -3,6 +3,9 @@
 
 #include "lasm.h"
 #include "ltable.h"
+#include "lstring.h"
+#include "lgc.h"
+#include "lbin.h"
 
 typedef struct {
     int count;
@@ -11,21 +14,56 @@ typedef struct {
 
 typedef struct {
     int count;
-    A_Instr *instrs;
+    uint32_t *code;     /* encoded as in lasm.h, maybe right in the (private) mapping */
 } V_InstrStream;
 
+/* inline cache of a constant key lookup, valid while the table keeps `shape' */
+typedef struct {
+    uint64_t shape;
+    int slot;
+} V_ICache;
+
 typedef struct {
     char name[MAX_NAME_LEN];
     int param;
     int regcount;
+    int nups;       /* upvalues, one more than the highest GETUPVAL/SETUPVAL uses */
     V_ValueStream k;
     V_InstrStream ins;
+    V_ICache *ic;   /* one per instruction */
     V_ValueStream subf;
+    const B_Func *lazy; /* body still in the mapping, NULL once decoded */
 } V_Func;
 
+/* sections of a mapped v2 file */
+typedef struct {
+    const unsigned char *sec[B_NUM_SECS];
+    uint32_t size[B_NUM_SECS];
+} V_Bin;
+
+typedef struct {
+    int count;
+    V_Func *funcs;
+} V_FuncStream;
+
+/*
+** A variable captured by closures. Open while the variable is still in a
+** register: `v' points to it, and it is in the open list of the state.
+** Closed when the register goes away: the value moves into `value' and
+** `v' points there.
+*/
+typedef struct V_UpVal {
+    GC_HEADER;
+    Value *v;
+    Value value;
+    struct V_UpVal *next;   /* open ones, from the highest stack slot down */
+} V_UpVal;
+
 typedef struct {
+    GC_HEADER;
     int fnidx;
-    V_ValueStream uv;
+    int nups;
+    V_UpVal *uv[];
 } V_Closure;
 
 typedef struct {
@@ -40,28 +78,50 @@ typedef struct {
     int retb;   /* return to reg begin */
     int rete;   /*               end */
     int base; /* stack slot of this func */
+    V_Closure *cl;  /* running, its upvalues; NULL for main */
 } V_CallInfo;
 
+/* frames of the running calls, the last one is `curci' */
 typedef struct {
     int size;
     int count;
-    V_CallInfo **values;
+    int max;    /* deepest call allowed, V_MAX_CI unless set after V_newstate */
+    V_CallInfo *values;
 } V_CallInfoStream;
 
-typedef struct {
+typedef enum {
+    V_TRACE_OFF,    /* no tracing at all */
+    V_TRACE_CALL,   /* dump state on CALL, TAILCALL and RETURN */
+    V_TRACE_INS,    /* dump every instruction and the state after it */
+} V_TraceLevel;
+
+typedef struct V_State {
     int major;
     int minor;
 
-    ltable *globals;
-
-    list *funcs;    /* main function always at head */
+    V_TraceLevel trace;
 
-    V_Closure *cl;
+    ltable *globals;
+    lstrtab *strs;  /* interned strings */
+    V_GC gc;
+
+    V_FuncStream funcs;    /* indexed by fnidx, main function always at 0 */
+    void *bin;      /* the mapped .lbin, string constants point into it */
+    size_t binsize;
+    char *binfile;
+    V_Bin secs;     /* of a v2/v3 file */
+    V_ValueStream k;    /* its CONSTS, each made once on first use; nil: not yet */
+    int lazy;       /* decode v2 function bodies on first use, the default */
+    int fuse;       /* rewrite common pairs into superinstructions, the default */
+
+    V_UpVal *openuv;    /* open upvalues, sorted by stack slot, highest first */
     V_Stack stk;
     V_CallInfoStream cis;
     V_CallInfo *curci;
 } V_State;
 
+#define V_MIN_STACK 32  /* slots, the stack grows as needed */
+
 V_State* V_newstate(int stacksize);
 void V_freestate(V_State *vs);
 
@@ -1,13 +1,21 @@
 #include "luna.h"
 #include "lasm.h"
 #include "lvm.h"
+#include "lopt.h"
 
 static void usage(const char *pname) {
-    printf("%s [-op] filename\n", pname);
+    printf("%s [-op] [-O0|-O1|-O2] [-j<n>] filename\n", pname);
     printf("op:\n"
             "\tla: lexer .lasm\n"
             "\tas: assemble .lasm to .lbin\n"
+            "\tas1: assemble .lasm to the old (v1) .lbin format\n"
             "\tvm: run .lbin\n"
+            "\tvmplain: run .lbin without superinstructions\n"
+            "\tvmeager: run .lbin, decoding every function up front\n"
+            "\tvmcall: run .lbin, dump state on every call and return\n"
+            "\tvmtrace: run .lbin, dump every instruction and state\n"
+            "-O<n>: optimization level of as and as1, 0 (the default) to %d\n"
+            "-j<n>: as on n threads\n", O_MAXLEVEL
     );
 }
 
@@ -25,15 +33,40 @@ static void lexer_asm(const char *filename) {
     A_freestate(as); as = NULL;
 }
 
-static void assemble_asm(const char *filename) {
+static void optimize_func(A_State *as, A_Func *fn, void *ud) {
+    O_optimizefunc(as, fn, *CAST(const int*, ud));
+}
+
+static void assemble_asm(const char *filename, int v1, int level, int nthreads) {
     A_State *as = A_newstate(filename);
-    A_parse(as);
-    A_createbin(as, "a.lbin");
+    if (v1) {
+        /* the function count goes first, all must be there */
+        A_parse(as);
+        O_optimize(as, level);
+        A_createbin_v1(as, "a.lbin");
+    } else if (nthreads > 1) {
+        A_Bin *ab = A_newbin();
+        A_parallel(as, ab, nthreads, optimize_func, &level);
+        A_closebin(ab, "a.lbin");
+    } else {
+        /* streamed: each function is written out and freed once parsed */
+        A_Bin *ab = A_newbin();
+        A_Func *fn;
+        while ((fn = A_parsefunc(as)) != NULL) {
+            O_optimizefunc(as, fn, level);
+            A_binfunc(ab, as, fn);
+            A_freefuncs(as);
+        }
+        A_closebin(ab, "a.lbin");
+    }
     A_freestate(as); as = NULL;
 }
 
-static void vm_bin(const char *filename) {
-    V_State *vs = V_newstate(1024); /* TODO: any better value? */
+static void vm_bin(const char *filename, V_TraceLevel trace, int fuse, int lazy) {
+    V_State *vs = V_newstate(V_MIN_STACK);
+    vs->trace = trace;
+    vs->fuse = fuse;
+    vs->lazy = lazy;
     V_load(vs, filename);
     V_run(vs);
     V_freestate(vs); vs = NULL;
@@ -41,19 +74,41 @@ static void vm_bin(const char *filename) {
 
 int main(int argc, const char **argv) {
     const char* pname = argv[0];
-    if (argc != 3) {
+    if (argc < 3) {
         usage(pname);
         exit(-1);
     }
 
     const char *opt = argv[1];
-    const char *filename = argv[2];
+    const char *filename = argv[argc - 1];
+    int level = 0;
+    int nthreads = 1;
+    for (int i = 2; i < argc - 1; ++i) {
+        const char *o = argv[i];
+        if (o[0] == '-' && o[1] == 'O' && o[2] >= '0' && o[2] <= '0' + O_MAXLEVEL && o[3] == '\0') {
+            level = o[2] - '0';
+        } else if (o[0] == '-' && o[1] == 'j' && (nthreads = atoi(o + 2)) > 0) {
+        } else {
+            usage(pname);
+            exit(-1);
+        }
+    }
     if (strcmp(opt, "-la") == 0) {
         lexer_asm(filename);
     } else if (strcmp(opt, "-as") == 0) {
-        assemble_asm(filename);
+        assemble_asm(filename, 0, level, nthreads);
+    } else if (strcmp(opt, "-as1") == 0) {
+        assemble_asm(filename, 1, level, 1);
     } else if (strcmp(opt, "-vm") == 0) {
-        vm_bin(filename);
+        vm_bin(filename, V_TRACE_OFF, 1, 1);
+    } else if (strcmp(opt, "-vmplain") == 0) {
+        vm_bin(filename, V_TRACE_OFF, 0, 1);
+    } else if (strcmp(opt, "-vmeager") == 0) {
+        vm_bin(filename, V_TRACE_OFF, 1, 0);
+    } else if (strcmp(opt, "-vmcall") == 0) {
+        vm_bin(filename, V_TRACE_CALL, 1, 1);
+    } else if (strcmp(opt, "-vmtrace") == 0) {
+        vm_bin(filename, V_TRACE_INS, 1, 1);
     } else {
         usage(pname);
         exit(-1);